@@ -1,5 +1,7 @@
 #include "744051.h"
-#include "hardware/adc.h"
+#include "744051_adc.h"
+#include "hardware/divider.h"
+#include "trace.h"
 #include <stdio.h>
 
 /**
@@ -52,7 +54,7 @@ void init_744051(C744051 *c744051, uint8_t common, uint8_t disable, uint8_t S0,
  *
  * @return The input select used in the adc_select_input() function.
  */
-uint8_t _analog_pin_to_input_select(uint8_t analog_pin) {
+uint8_t __time_critical_func(_analog_pin_to_input_select)(uint8_t analog_pin) {
     return analog_pin - 26;
 }
 
@@ -64,7 +66,7 @@ uint8_t _analog_pin_to_input_select(uint8_t analog_pin) {
  *
  * @param[in] c744051 744051 struct.
  */
-void _select_adc_input_744051(C744051 c744051) {
+void __time_critical_func(_select_adc_input_744051)(C744051 c744051) {
     if (adc_get_selected_input() != _analog_pin_to_input_select(c744051.common)) {
         adc_select_input(_analog_pin_to_input_select(c744051.common));
     }
@@ -79,7 +81,7 @@ void _select_adc_input_744051(C744051 c744051) {
  * @param[in] c744051 744051 struct.
  * @param[in] channel Channel to select (0-7).
  */
-void _select_input_744051(C744051 c744051, uint8_t channel) {
+void __time_critical_func(_select_input_744051)(C744051 c744051, uint8_t channel) {
     uint32_t state_mask = 0;
     state_mask |= (((channel & 0b001)) << c744051.S0);
     state_mask |= (((channel & 0b010) >> 1) << c744051.S1);
@@ -87,6 +89,19 @@ void _select_input_744051(C744051 c744051, uint8_t channel) {
     gpio_put_masked(c744051.pin_mask, state_mask);
 }
 
+/**
+ * @brief Waits 5us for the ADC input to settle.
+ *
+ * Busy waits on the timer instead of sleep_us so the read functions run entirely from RAM and
+ * keep working on the other core while the flash is being written.
+ */
+void __time_critical_func(_settle_744051)() {
+    uint32_t start = time_us_32();
+    while (time_us_32() - start < 5) {
+        tight_loop_contents();
+    }
+}
+
 /**
  * @brief Reads single analog value from one 744051 IC.
  * 
@@ -99,7 +114,7 @@ void _select_input_744051(C744051 c744051, uint8_t channel) {
  *
  * @return The analog value.
  */
-uint16_t _read_single_744051_channel(uint8_t samples) {
+uint16_t __time_critical_func(_read_single_744051_channel)(uint8_t samples) {
     if (samples <= 1) {
         return adc_read();
     }
@@ -108,7 +123,7 @@ uint16_t _read_single_744051_channel(uint8_t samples) {
     for (int i = 0; i < samples; i++) {
         sum += adc_read();
     }
-    return sum / samples;
+    return hw_divider_u32_quotient_inlined(sum, samples);
 }
 
 /**
@@ -121,7 +136,8 @@ uint16_t _read_single_744051_channel(uint8_t samples) {
  * @param[in] extra_precision Due to the ADC's capacitance, there is a small error of +-20mV due to the speed in which this function
  * operates at, enabling this option increases the time of measurement for more accuracy, pair this with high sample.
  */
-void read_744051_masked(C744051 c744051, uint8_t read_pin_mask, uint8_t samples, uint16_t *data, bool extra_precision) {
+void __time_critical_func(read_744051_masked)(C744051 c744051, uint8_t read_pin_mask, uint8_t samples, uint16_t *data, bool extra_precision) {
+    TRACE_BEGIN(TRACE_ADC_SCAN);
     _select_adc_input_744051(c744051);
 
     uint8_t data_counter = 0;
@@ -130,12 +146,13 @@ void read_744051_masked(C744051 c744051, uint8_t read_pin_mask, uint8_t samples,
             _select_input_744051(c744051, channel);
 
             if (extra_precision) {
-                sleep_us(5);
+                _settle_744051();
             }
 
             data[data_counter++] = _read_single_744051_channel(samples);
         }
     }
+    TRACE_END(TRACE_ADC_SCAN);
 }
 
 /**
@@ -155,7 +172,8 @@ void read_744051_masked(C744051 c744051, uint8_t read_pin_mask, uint8_t samples,
  * @param[in] extra_precision Due to the ADC's capacitance, there is a small error of +-20mV due to the speed in which this function
  * operates at, enabling this option increases the time of measurement for more accuracy, pair this with high sample.
 */
-void read_multiple_744051(C744051 *c744051, uint8_t ic_count, uint8_t samples, uint16_t *data, bool extra_precision) {
+void __time_critical_func(read_multiple_744051)(C744051 *c744051, uint8_t ic_count, uint8_t samples, uint16_t *data, bool extra_precision) {
+    TRACE_BEGIN(TRACE_ADC_SCAN);
     for (uint8_t channel = 0; channel < 8; ++channel) {
         _select_input_744051(c744051[0], channel);
 
@@ -167,7 +185,7 @@ void read_multiple_744051(C744051 *c744051, uint8_t ic_count, uint8_t samples, u
             }
 
             if (extra_precision) {
-                sleep_us(5);
+                _settle_744051();
             }
 
             _select_adc_input_744051(ic);
@@ -180,6 +198,7 @@ void read_multiple_744051(C744051 *c744051, uint8_t ic_count, uint8_t samples, u
             }
         }
     }
+    TRACE_END(TRACE_ADC_SCAN);
 }
 
 double adc_to_voltage(int adc_value) {
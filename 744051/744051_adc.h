@@ -0,0 +1,19 @@
+#ifndef C744051_ADC_H
+#define C744051_ADC_H
+
+#include "pico/stdlib.h"
+
+// ADC used by the 744051 driver.
+// On device this is the RP2040 ADC, host/744051_adc_host.c emulates it so the driver can run on
+// PICO_PLATFORM=host.
+#if PICO_ON_DEVICE
+#include "hardware/adc.h"
+#else
+void adc_init();
+void adc_gpio_init(uint gpio);
+void adc_select_input(uint input);
+uint adc_get_selected_input();
+uint16_t adc_read();
+#endif
+
+#endif
@@ -0,0 +1,36 @@
+#include "744051_adc.h"
+
+// Stand-in for the RP2040 ADC when building with PICO_PLATFORM=host.
+// - a conversion busy waits 2us, 96 cycles of the 48MHz ADC clock
+// - readings are a slow ramp per input with a little noise, enough to exercise the callers
+
+#define C744051_HOST_CONVERSION_US 2
+
+uint _adcHostInput = 0;
+uint32_t _adcHostReadCount = 0;
+
+void adc_init() {
+    _adcHostInput = 0;
+}
+
+void adc_gpio_init(uint gpio) {
+}
+
+void adc_select_input(uint input) {
+    _adcHostInput = input;
+}
+
+uint adc_get_selected_input() {
+    return _adcHostInput;
+}
+
+uint16_t adc_read() {
+    uint32_t start = time_us_32();
+    while (time_us_32() - start < C744051_HOST_CONVERSION_US) {
+        tight_loop_contents();
+    }
+
+    _adcHostReadCount++;
+    uint32_t noise = (_adcHostReadCount * 2654435761u) >> 29;
+    return (_adcHostInput * 1024 + (_adcHostReadCount >> 4) + noise) & 0xFFF;
+}
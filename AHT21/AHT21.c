@@ -1,42 +1,512 @@
+#include <stdlib.h>
 #include "AHT21.h"
 
-float _humidityFromRawData(uint8_t *rawData) {
+const uint8_t MEASURE_COMMAND[3] = {0xAC, 0x33, 0x00};
+
+// I2C switches seen on each bus and the channel mask each one has enabled, -1 if unknown
+uint8_t _switchAddresses[2][AHT21_MAX_SWITCHES];
+int16_t _switchMasks[2][AHT21_MAX_SWITCHES];
+uint8_t _switchCount[2];
+
+// Fixed point conversion, the M0+ has no FPU so floats are avoided on the hot path
+// humidity = raw / 2^20 * 100%, 10000 / 2^20 = 625 / 2^16 in centi-percent
+int32_t _humidityCentiFromRawData(const uint8_t *rawData) {
     uint32_t raw_humidity = (rawData[1] << 12) | (rawData[2] << 4) | ((rawData[3] & 0xF0) >> 4);
-    return ((float)raw_humidity / (float)(1 << 20)) * 100;
+    return (raw_humidity * 625 + (1 << 15)) >> 16;
 }
 
-float _temperatureFromRawData(uint8_t *rawData) {
+// temperature = raw / 2^20 * 200 - 50C, 20000 / 2^20 = 1250 / 2^16 in centi-degrees
+int32_t _temperatureCentiFromRawData(const uint8_t *rawData) {
     uint32_t raw_temperature = ((rawData[3] & 0x0F) << 16) | (rawData[4] << 8) | (rawData[5]);
-    return ((float)raw_temperature / (float)(1 << 20)) * 200 - 50;
+    return (int32_t) ((raw_temperature * 1250 + (1 << 15)) >> 16) - 5000;
+}
+
+void _AHT21_addSwitch(AHT21 *aht21) {
+    uint8_t bus = AHT21_i2cIndex(aht21->i2c_channel);
+    if (aht21->switchAddress == AHT21_NO_SWITCH) {
+        return;
+    }
+
+    for (uint8_t i = 0; i < _switchCount[bus]; i++) {
+        if (_switchAddresses[bus][i] == aht21->switchAddress) {
+            return;
+        }
+    }
+    if (_switchCount[bus] < AHT21_MAX_SWITCHES) {
+        _switchAddresses[bus][_switchCount[bus]] = aht21->switchAddress;
+        _switchMasks[bus][_switchCount[bus]] = -1;
+        _switchCount[bus]++;
+    }
+}
+
+// After a failed or aborted transaction any switch on the bus may be in any state
+void _AHT21_forgetSwitches(uint8_t bus) {
+    for (uint8_t i = 0; i < _switchCount[bus]; i++) {
+        _switchMasks[bus][i] = -1;
+    }
+}
+
+// Next switch write needed before the sensor can be addressed, false when none is left.
+// Every other switch on the bus is turned off first so only one sensor answers at the sensor
+// address, then the sensor channel is selected. Sensors without a switch turn all of them off.
+bool _AHT21_nextSwitchWrite(AHT21 *aht21, uint8_t *slot, uint8_t *mask) {
+    uint8_t bus = AHT21_i2cIndex(aht21->i2c_channel);
+    int8_t own = -1;
+
+    for (uint8_t i = 0; i < _switchCount[bus]; i++) {
+        if (_switchAddresses[bus][i] == aht21->switchAddress) {
+            own = i;
+        } else if (_switchMasks[bus][i] != 0) {
+            *slot = i;
+            *mask = 0;
+            return true;
+        }
+    }
+
+    if (own >= 0 && _switchMasks[bus][own] != (1 << aht21->switchChannel)) {
+        *slot = own;
+        *mask = 1u << aht21->switchChannel;
+        return true;
+    }
+    return false;
 }
 
-// Wait at least 100ms after power up to initiale the AHT21
-void AHT21_init(i2c_inst_t *i2c_channel) {
-    _i2c_channel = i2c_channel;
+void _AHT21_selectSwitchBlocking(AHT21 *aht21) {
+    uint8_t bus = AHT21_i2cIndex(aht21->i2c_channel);
+    uint8_t slot;
+    uint8_t mask;
+
+    while (_AHT21_nextSwitchWrite(aht21, &slot, &mask)) {
+        if (AHT21_i2cWriteBlocking(aht21->i2c_channel, _switchAddresses[bus][slot], &mask, 1) < 0) {
+            // Left as it was, the next selection writes it again
+            return;
+        }
+        _switchMasks[bus][slot] = mask;
+    }
+}
+
+/**
+ * @brief Initializes one AHT21.
+ *
+ * Wait at least 100ms after power up to initiale the AHT21.
+ *
+ * @param[in] aht21 Sensor to initialize.
+ * @param[in] i2c_channel i2c0 or i2c1, already initialized.
+ * @param[in] address Sensor address, usually AHT21_ADDRESS.
+ * @param[in] switchAddress Address of the i2c switch in front of the sensor, otherwise pass AHT21_NO_SWITCH.
+ * @param[in] switchChannel Switch channel the sensor is on (0-7).
+ */
+void AHT21_init(AHT21 *aht21, i2c_inst_t *i2c_channel, uint8_t address, uint8_t switchAddress, uint8_t switchChannel) {
+    aht21->i2c_channel = i2c_channel;
+    aht21->address = address;
+    aht21->switchAddress = switchAddress;
+    aht21->switchChannel = switchChannel;
+    aht21->state = AHT21_IDLE;
+    aht21->transaction = AHT21_TRANSACTION_NONE;
+    aht21->ready = false;
+    aht21->callback = NULL;
+    aht21->userData = NULL;
+
+    _AHT21_addSwitch(aht21);
+    _AHT21_selectSwitchBlocking(aht21);
+
     uint8_t src = AHT21_INIT_COMMAND;
     uint8_t answer[1];
-    i2c_write_blocking(_i2c_channel, 0x38, &src, 1, false);
-    i2c_read_blocking(_i2c_channel, 0x38, answer, 1, false);
+    AHT21_i2cWriteBlocking(i2c_channel, address, &src, 1);
+    AHT21_i2cReadBlocking(i2c_channel, address, answer, 1);
 }
 
 // Wait at least 10ms after init to start measurement
-void AHT21_startMeasurement() {
-    i2c_write_blocking(_i2c_channel, AHT21_ADDRESS, MEASURE_COMMAND, 3, false);
+void AHT21_startMeasurement(AHT21 *aht21) {
+    _AHT21_selectSwitchBlocking(aht21);
+    AHT21_i2cWriteBlocking(aht21->i2c_channel, aht21->address, MEASURE_COMMAND, 3);
 }
 
 // Wait at least 80ms after start measurement to read it
-void AHT21_readMeasurement(float *data) {
+// data[0] -> humidity in centi-percent, data[1] -> temperature in centi-degrees
+void AHT21_readMeasurementFixed(AHT21 *aht21, int32_t *data) {
     uint8_t rawData[7];
-    i2c_read_blocking(_i2c_channel, AHT21_ADDRESS, rawData, 7, false);
-    data[0] = _humidityFromRawData(rawData);
-    data[1] = _temperatureFromRawData(rawData);
+    _AHT21_selectSwitchBlocking(aht21);
+    AHT21_i2cReadBlocking(aht21->i2c_channel, aht21->address, rawData, 7);
+    data[0] = _humidityCentiFromRawData(rawData);
+    data[1] = _temperatureCentiFromRawData(rawData);
+}
+
+// Wait at least 80ms after start measurement to read it
+void AHT21_readMeasurement(AHT21 *aht21, float *data) {
+    int32_t fixed[2];
+    AHT21_readMeasurementFixed(aht21, fixed);
+    data[0] = fixed[0] / 100.0f;
+    data[1] = fixed[1] / 100.0f;
 }
 
 // Wait at least 10ms after init to start measurement
-void AHT21_getMeasurementBlocking(float *data) {
-    AHT21_startMeasurement();
+void AHT21_getMeasurementBlocking(AHT21 *aht21, float *data) {
+    AHT21_startMeasurement(aht21);
     sleep_ms(80);
-    AHT21_readMeasurement(data);
+    AHT21_readMeasurement(aht21, data);
+}
+
+// CRC-8, polynomial 0x31, initial value 0xFF
+uint8_t _AHT21_crc8(const uint8_t *data, uint8_t length) {
+    uint8_t crc = 0xFF;
+    for (uint8_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+void _AHT21_finish(AHT21 *aht21, AHT21Status status) {
+    aht21->measurement.status = status;
+    aht21->measurement.timestamp = time_us_32();
+    aht21->measurement.duration = aht21->measurement.timestamp - aht21->startTime;
+    if (status != AHT21_OK) {
+        // Drops whatever was left of the failed read so the next transaction on the bus starts clean
+        AHT21_i2cDrain(aht21->i2c_channel);
+    } else {
+        aht21->measurement.humidityCenti = _humidityCentiFromRawData(aht21->rawData);
+        aht21->measurement.temperatureCenti = _temperatureCentiFromRawData(aht21->rawData);
+        aht21->measurement.humidity = aht21->measurement.humidityCenti / 100.0f;
+        aht21->measurement.temperature = aht21->measurement.temperatureCenti / 100.0f;
+    }
+
+    aht21->state = AHT21_IDLE;
+    aht21->transaction = AHT21_TRANSACTION_NONE;
+    aht21->ready = true;
+    if (aht21->callback != NULL) {
+        aht21->callback(aht21, aht21->userData);
+    }
+}
+
+/**
+ * @brief Advances the measurement state machine by one step.
+ *
+ * If a transaction is in flight it is completed first:
+ * SWITCH: the switch written now has the new channel mask.
+ * MEASURE: the sensor is converting, the bus is free until the first poll.
+ * STATUS: while busy the bus is freed until the next poll, otherwise the data read is queued.
+ * DATA: the CRC is checked and the measurement finishes.
+ * Otherwise the next transaction is queued, turning off the other switches on the bus and selecting
+ * the switch channel first when needed.
+ * On timeout a transaction still in flight is aborted so the bus is free for the next sensor.
+ *
+ * @return Time until the next step in microseconds, 0 when finished.
+ */
+int64_t _AHT21_step(AHT21 *aht21) {
+    i2c_inst_t *i2c_channel = aht21->i2c_channel;
+
+    if (time_us_32() - aht21->startTime > AHT21_TIMEOUT_US) {
+        if (aht21->transaction != AHT21_TRANSACTION_NONE) {
+            // The bus goes to the next sensor right after, nothing of this one may be left on it
+            AHT21_i2cAbort(i2c_channel);
+        }
+        _AHT21_forgetSwitches(AHT21_i2cIndex(i2c_channel));
+        _AHT21_finish(aht21, AHT21_ERROR_TIMEOUT);
+        return 0;
+    }
+
+    if (aht21->transaction != AHT21_TRANSACTION_NONE) {
+        if (!AHT21_i2cIdle(i2c_channel)) {
+            return AHT21_I2C_WAIT_US;
+        }
+
+        if (AHT21_i2cAborted(i2c_channel)) {
+            _AHT21_forgetSwitches(AHT21_i2cIndex(i2c_channel));
+            _AHT21_finish(aht21, AHT21_ERROR_NACK);
+            return 0;
+        }
+
+        switch (aht21->transaction) {
+            case AHT21_TRANSACTION_SWITCH:
+                _switchMasks[AHT21_i2cIndex(i2c_channel)][aht21->switchSlot] = aht21->switchMask;
+                aht21->transaction = AHT21_TRANSACTION_NONE;
+                break;
+
+            case AHT21_TRANSACTION_MEASURE:
+                aht21->transaction = AHT21_TRANSACTION_NONE;
+                aht21->state = AHT21_CONVERTING;
+                return AHT21_FIRST_POLL_US;
+
+            case AHT21_TRANSACTION_STATUS:
+                if (AHT21_i2cReadAvailable(i2c_channel) < 1) {
+                    return AHT21_I2C_WAIT_US;
+                }
+                AHT21_i2cCollectRead(i2c_channel, aht21->rawData, 1);
+
+                if (aht21->rawData[0] & AHT21_STATUS_BUSY) {
+                    aht21->transaction = AHT21_TRANSACTION_NONE;
+                    return AHT21_POLL_INTERVAL_US;
+                }
+
+                // Still selected, so the data read goes right away
+                AHT21_i2cQueueRead(i2c_channel, aht21->address, 7);
+                aht21->transaction = AHT21_TRANSACTION_DATA;
+                aht21->state = AHT21_READING;
+                return AHT21_I2C_WAIT_US;
+
+            case AHT21_TRANSACTION_DATA:
+                if (AHT21_i2cReadAvailable(i2c_channel) < 7) {
+                    return AHT21_I2C_WAIT_US;
+                }
+                AHT21_i2cCollectRead(i2c_channel, aht21->rawData, 7);
+
+                if (_AHT21_crc8(aht21->rawData, 6) != aht21->rawData[6]) {
+                    _AHT21_finish(aht21, AHT21_ERROR_CRC);
+                } else {
+                    _AHT21_finish(aht21, AHT21_OK);
+                }
+                return 0;
+
+            default:
+                break;
+        }
+    }
+
+    if (_AHT21_nextSwitchWrite(aht21, &aht21->switchSlot, &aht21->switchMask)) {
+        AHT21_i2cQueueWrite(i2c_channel, _switchAddresses[AHT21_i2cIndex(i2c_channel)][aht21->switchSlot], &aht21->switchMask, 1);
+        aht21->transaction = AHT21_TRANSACTION_SWITCH;
+        return AHT21_I2C_WAIT_US;
+    }
+
+    if (aht21->state == AHT21_STARTING) {
+        AHT21_i2cQueueWrite(i2c_channel, aht21->address, MEASURE_COMMAND, 3);
+        aht21->transaction = AHT21_TRANSACTION_MEASURE;
+    } else {
+        AHT21_i2cQueueRead(i2c_channel, aht21->address, 1);
+        aht21->transaction = AHT21_TRANSACTION_STATUS;
+    }
+    return AHT21_I2C_WAIT_US;
+}
+
+void _AHT21_begin(AHT21 *aht21, AHT21Callback callback, void *userData) {
+    aht21->callback = callback;
+    aht21->userData = userData;
+    aht21->ready = false;
+    aht21->startTime = time_us_32();
+    aht21->nextStep = aht21->startTime;
+    aht21->transaction = AHT21_TRANSACTION_NONE;
+    aht21->state = AHT21_STARTING;
+}
+
+int64_t _AHT21_alarmCallback(alarm_id_t id, void *user_data) {
+    return _AHT21_step((AHT21 *) user_data);
+}
+
+/**
+ * @brief Starts a measurement without blocking.
+ *
+ * The measurement runs from alarms, it finishes as soon as the sensor clears its busy bit and the
+ * result is delivered to callback and to aht21->measurement. The first step runs right away, it
+ * may run here in the caller but it only queues the first transaction, so callback always runs
+ * from the alarm IRQ except for AHT21_ERROR_NO_ALARM, which is delivered here before returning.
+ * The bus must not be used by anything else until it finishes, use AHT21_startFleet for
+ * several sensors.
+ * Wait at least 10ms after init to start measurement.
+ *
+ * @param[in] aht21 Sensor to measure.
+ * @param[in] callback Called with the result, can be NULL and then AHT21_isMeasurementReady is polled.
+ * @param[in] userData Passed to callback.
+ *
+ * @return false if a measurement is already running on this sensor. When no alarm can be added the
+ * measurement finishes right away with AHT21_ERROR_NO_ALARM.
+ */
+bool AHT21_startMeasurementAsync(AHT21 *aht21, AHT21Callback callback, void *userData) {
+    if (aht21->state != AHT21_IDLE) {
+        return false;
+    }
+
+    AHT21_i2cAborted(aht21->i2c_channel);
+    _AHT21_begin(aht21, callback, userData);
+    // Fires at once, possibly from here, the first step never finishes the measurement
+    if (add_alarm_in_us(0, _AHT21_alarmCallback, aht21, true) < 0) {
+        // Nothing would ever step the sensor, it goes back to idle
+        _AHT21_finish(aht21, AHT21_ERROR_NO_ALARM);
+    }
+    return true;
+}
+
+// True once the measurement started with AHT21_startMeasurementAsync finished, clears the flag
+bool AHT21_isMeasurementReady(AHT21 *aht21) {
+    if (!aht21->ready) {
+        return false;
+    }
+    aht21->ready = false;
+    return true;
+}
+
+void _AHT21_fleetMeasurementDone(AHT21 *aht21, void *userData) {
+    AHT21Fleet *fleet = (AHT21Fleet *) userData;
+
+    fleet->measurementCount++;
+    if (aht21->measurement.status != AHT21_OK) {
+        fleet->errorCount++;
+    }
+
+    if (fleet->callback != NULL) {
+        fleet->callback(aht21, fleet->userData);
+    }
+}
+
+bool _AHT21_due(uint32_t now, uint32_t time) {
+    return (int32_t) (now - time) >= 0;
+}
+
+/**
+ * @brief Fleet scheduler tick.
+ *
+ * Each bus runs one transaction at a time. The owner of a bus is stepped until its transaction
+ * completes, then the bus goes to the next sensor (round robin) that is due, so while one sensor
+ * converts the others use the bus.
+ * Called from the fleet timer, or by the user every AHT21_I2C_WAIT_US for fleets started with
+ * AHT21_startFleetPolled.
+ *
+ * @param[in] fleet Fleet to step.
+ */
+void AHT21_pollFleet(AHT21Fleet *fleet) {
+    uint32_t now = time_us_32();
+
+    for (uint8_t i = 0; i < fleet->sensorCount; i++) {
+        AHT21 *aht21 = fleet->sensors[i];
+        if (aht21->state == AHT21_IDLE && _AHT21_due(now, fleet->nextStart[i])) {
+            fleet->nextStart[i] += fleet->periodUs;
+            if (_AHT21_due(now, fleet->nextStart[i])) {
+                // Fell behind, drop the missed periods
+                fleet->nextStart[i] = now + fleet->periodUs;
+            }
+            _AHT21_begin(aht21, _AHT21_fleetMeasurementDone, fleet);
+        }
+    }
+
+    for (uint8_t bus = 0; bus < 2; bus++) {
+        AHT21 *owner = fleet->busOwner[bus];
+
+        if (owner != NULL) {
+            if (!_AHT21_due(now, owner->nextStep)) {
+                continue;
+            }
+            owner->nextStep = now + _AHT21_step(owner);
+            if (owner->transaction != AHT21_TRANSACTION_NONE) {
+                continue;
+            }
+            fleet->busOwner[bus] = NULL;
+        }
+
+        for (uint8_t n = 0; n < fleet->sensorCount; n++) {
+            uint8_t i = (fleet->nextSensor[bus] + n) % fleet->sensorCount;
+            AHT21 *aht21 = fleet->sensors[i];
+            if (AHT21_i2cIndex(aht21->i2c_channel) != bus || aht21->state == AHT21_IDLE || !_AHT21_due(now, aht21->nextStep)) {
+                continue;
+            }
+
+            aht21->nextStep = now + _AHT21_step(aht21);
+            if (aht21->transaction != AHT21_TRANSACTION_NONE) {
+                fleet->busOwner[bus] = aht21;
+            }
+            fleet->nextSensor[bus] = (i + 1) % fleet->sensorCount;
+            break;
+        }
+    }
+}
+
+bool _AHT21_fleetTimerCallback(repeating_timer_t *timer) {
+    AHT21_pollFleet((AHT21Fleet *) timer->user_data);
+    return true;
+}
+
+bool _AHT21_setupFleet(AHT21Fleet *fleet, AHT21 **sensors, uint8_t sensorCount, uint32_t periodUs, AHT21Callback callback, void *userData) {
+    fleet->sensors = sensors;
+    fleet->sensorCount = sensorCount;
+    fleet->periodUs = periodUs;
+    fleet->callback = callback;
+    fleet->userData = userData;
+    fleet->busOwner[0] = NULL;
+    fleet->busOwner[1] = NULL;
+    fleet->nextSensor[0] = 0;
+    fleet->nextSensor[1] = 0;
+    fleet->measurementCount = 0;
+    fleet->errorCount = 0;
+    fleet->nextStart = (uint32_t *) malloc(sensorCount * sizeof(uint32_t));
+    if (fleet->nextStart == NULL) {
+        return false;
+    }
+
+    uint32_t now = time_us_32();
+    for (uint8_t i = 0; i < sensorCount; i++) {
+        fleet->nextStart[i] = now + (uint64_t) periodUs * i / sensorCount;
+        AHT21_i2cAborted(sensors[i]->i2c_channel);
+    }
+    return true;
+}
+
+/**
+ * @brief Measures many sensors continuously, on i2c0 and i2c1 and behind i2c switches.
+ *
+ * Measurement starts are staggered over the period so the conversions overlap and the bus is
+ * shared between sensors while they convert. Results are delivered to callback from the timer IRQ.
+ * The buses must not be used by anything else while the fleet runs.
+ *
+ * @param[in] fleet Fleet to start.
+ * @param[in] sensors Initialized sensors, the array must stay valid while the fleet runs.
+ * @param[in] sensorCount Number of sensors.
+ * @param[in] periodUs Time between measurements of the same sensor, 0 measures as fast as possible.
+ * @param[in] callback Called with every finished measurement, the result is in aht21->measurement.
+ * @param[in] userData Passed to callback.
+ *
+ * @return false if the schedule can't be allocated or no timer is left, the fleet is not running then.
+ */
+bool AHT21_startFleet(AHT21Fleet *fleet, AHT21 **sensors, uint8_t sensorCount, uint32_t periodUs, AHT21Callback callback, void *userData) {
+    if (!_AHT21_setupFleet(fleet, sensors, sensorCount, periodUs, callback, userData)) {
+        return false;
+    }
+
+    fleet->polled = false;
+    if (!add_repeating_timer_us(-AHT21_I2C_WAIT_US, _AHT21_fleetTimerCallback, fleet, &fleet->timer)) {
+        free(fleet->nextStart);
+        fleet->nextStart = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Same as AHT21_startFleet but without the timer, AHT21_pollFleet must be called every AHT21_I2C_WAIT_US.
+ *
+ * Lets the fleet run from a loop on the core doing acquisition, results are delivered to callback
+ * from AHT21_pollFleet.
+ *
+ * @return false if the schedule can't be allocated.
+ */
+bool AHT21_startFleetPolled(AHT21Fleet *fleet, AHT21 **sensors, uint8_t sensorCount, uint32_t periodUs, AHT21Callback callback, void *userData) {
+    if (!_AHT21_setupFleet(fleet, sensors, sensorCount, periodUs, callback, userData)) {
+        return false;
+    }
+
+    fleet->polled = true;
+    return true;
+}
+
+// Stops starting new measurements, the ones running are dropped and a transaction still in flight
+// is aborted so the buses are free when it returns
+void AHT21_stopFleet(AHT21Fleet *fleet) {
+    if (!fleet->polled) {
+        cancel_repeating_timer(&fleet->timer);
+    }
+    for (uint8_t bus = 0; bus < 2; bus++) {
+        AHT21 *owner = fleet->busOwner[bus];
+        if (owner != NULL && owner->transaction != AHT21_TRANSACTION_NONE) {
+            AHT21_i2cAbort(owner->i2c_channel);
+            _AHT21_forgetSwitches(bus);
+        }
+        fleet->busOwner[bus] = NULL;
+    }
+    for (uint8_t i = 0; i < fleet->sensorCount; i++) {
+        fleet->sensors[i]->state = AHT21_IDLE;
+        fleet->sensors[i]->transaction = AHT21_TRANSACTION_NONE;
+    }
+    free(fleet->nextStart);
 }
 
 // Pins 4, 5 -> i2c
@@ -55,7 +525,8 @@ void AHT21_example() {
 
     // Init AHT21
     sleep_ms(100);
-    AHT21_init(i2c0);
+    AHT21 aht21;
+    AHT21_init(&aht21, i2c0, AHT21_ADDRESS, AHT21_NO_SWITCH, 0);
 
     while (true) {
         sleep_ms(1000);
@@ -67,9 +538,11 @@ void AHT21_example() {
 
         // Gets measurement
         float data[2];
-        AHT21_getMeasurementBlocking(data);
+        AHT21_getMeasurementBlocking(&aht21, data);
         printf("H:%.2f%%, T:%.2fC\n", data[0], data[1]);
 
+#if PICO_ON_DEVICE
         watchdog_update();
+#endif
     }
 }
@@ -2,17 +2,109 @@
 #define AHT21_H
 
 #include "pico/stdlib.h"
-#include "hardware/i2c.h"
+#include "AHT21_i2c.h"
 
 #define AHT21_ADDRESS 0x38
 #define AHT21_INIT_COMMAND 0x71
-const uint8_t MEASURE_COMMAND[3] = {0xAC, 0x33, 0x00};
-i2c_inst_t *_i2c_channel;
+#define AHT21_STATUS_BUSY 0x80
 
-void AHT21_init(i2c_inst_t *i2c_channel);
-void AHT21_startMeasurement();
-void AHT21_readMeasurement(float *data);
-void AHT21_getMeasurementBlocking(float *data);
+// Used as switchAddress when the sensor is connected straight to the bus
+#define AHT21_NO_SWITCH 255
+// I2C switches tracked per bus, TCA9548A like switches only have 8 addresses
+#define AHT21_MAX_SWITCHES 8
+
+// Async timing, the sensor is polled from AHT21_FIRST_POLL_US until it is ready
+#define AHT21_FIRST_POLL_US 40000
+#define AHT21_POLL_INTERVAL_US 2000
+#define AHT21_I2C_WAIT_US 200
+#define AHT21_TIMEOUT_US 150000
+
+typedef enum AHT21State {
+    AHT21_IDLE,
+    AHT21_STARTING,
+    AHT21_CONVERTING,
+    AHT21_READING,
+} AHT21State;
+
+typedef enum AHT21Transaction {
+    AHT21_TRANSACTION_NONE,
+    AHT21_TRANSACTION_SWITCH,
+    AHT21_TRANSACTION_MEASURE,
+    AHT21_TRANSACTION_STATUS,
+    AHT21_TRANSACTION_DATA,
+} AHT21Transaction;
+
+typedef enum AHT21Status {
+    AHT21_OK,
+    AHT21_ERROR_NACK,
+    AHT21_ERROR_CRC,
+    AHT21_ERROR_TIMEOUT,
+    AHT21_ERROR_NO_ALARM,  // No alarm slot left to run the measurement
+} AHT21Status;
+
+typedef struct AHT21Measurement {
+    AHT21Status status;
+    int32_t humidityCenti;  // 0.01%
+    int32_t temperatureCenti;  // 0.01C
+    float humidity;
+    float temperature;
+    uint32_t timestamp;  // time_us_32() when the result arrived
+    uint32_t duration;  // Time from start to result in us
+} AHT21Measurement;
+
+typedef struct AHT21 AHT21;
+typedef void (*AHT21Callback)(AHT21 *aht21, void *userData);
+
+typedef struct AHT21 {
+    i2c_inst_t *i2c_channel;
+    uint8_t address;
+    uint8_t switchAddress;  // I2C switch (TCA9548A like) in front of the sensor, or AHT21_NO_SWITCH
+    uint8_t switchChannel;
+
+    // Async state
+    volatile AHT21State state;
+    volatile AHT21Transaction transaction;
+    uint8_t switchSlot;  // Switch written by the SWITCH transaction in flight and the mask written
+    uint8_t switchMask;
+    volatile bool ready;
+    uint32_t startTime;
+    uint32_t nextStep;
+    uint8_t rawData[7];
+    AHT21Measurement measurement;
+    AHT21Callback callback;
+    void *userData;
+} AHT21;
+
+typedef struct AHT21Fleet {
+    AHT21 **sensors;
+    uint8_t sensorCount;
+    uint32_t periodUs;
+    AHT21Callback callback;
+    void *userData;
+
+    // Sensor with a transaction in flight on each bus, one at a time
+    AHT21 *busOwner[2];
+    uint8_t nextSensor[2];
+    uint32_t *nextStart;
+    repeating_timer_t timer;
+    bool polled;  // Stepped by AHT21_pollFleet instead of the timer
+
+    // Statistics
+    volatile uint32_t measurementCount;
+    volatile uint32_t errorCount;
+} AHT21Fleet;
+
+void AHT21_init(AHT21 *aht21, i2c_inst_t *i2c_channel, uint8_t address, uint8_t switchAddress, uint8_t switchChannel);
+void AHT21_startMeasurement(AHT21 *aht21);
+void AHT21_readMeasurement(AHT21 *aht21, float *data);
+void AHT21_readMeasurementFixed(AHT21 *aht21, int32_t *data);
+void AHT21_getMeasurementBlocking(AHT21 *aht21, float *data);
+bool AHT21_startMeasurementAsync(AHT21 *aht21, AHT21Callback callback, void *userData);
+bool AHT21_isMeasurementReady(AHT21 *aht21);
+bool AHT21_startFleet(AHT21Fleet *fleet, AHT21 **sensors, uint8_t sensorCount, uint32_t periodUs, AHT21Callback callback, void *userData);
+bool AHT21_startFleetPolled(AHT21Fleet *fleet, AHT21 **sensors, uint8_t sensorCount, uint32_t periodUs, AHT21Callback callback, void *userData);
+void AHT21_pollFleet(AHT21Fleet *fleet);
+void AHT21_stopFleet(AHT21Fleet *fleet);
 void AHT21_example();
 
 #endif
@@ -0,0 +1,39 @@
+#ifndef AHT21_I2C_H
+#define AHT21_I2C_H
+
+#include "pico/stdlib.h"
+
+// i2c used by the AHT21 driver.
+// AHT21_i2c_pico.c talks to the RP2040 i2c blocks, host/AHT21_i2c_host.c emulates AHT21
+// sensors so the driver can run on PICO_PLATFORM=host.
+#if PICO_ON_DEVICE
+#include "hardware/i2c.h"
+#else
+typedef struct i2c_inst i2c_inst_t;
+extern i2c_inst_t *i2c0;
+extern i2c_inst_t *i2c1;
+uint i2c_init(i2c_inst_t *i2c, uint baudrate);
+
+bool AHT21_hostAddSensor(i2c_inst_t *i2c_channel, uint8_t address, float humidity, float temperature);
+void AHT21_hostSetConversionTime(uint32_t conversionUs);
+uint32_t AHT21_hostTransactionCount(i2c_inst_t *i2c_channel);
+#endif
+
+uint8_t AHT21_i2cIndex(i2c_inst_t *i2c_channel);
+
+// Blocking, return the number of bytes transferred or PICO_ERROR_GENERIC if not acknowledged
+int AHT21_i2cWriteBlocking(i2c_inst_t *i2c_channel, uint8_t address, const uint8_t *src, uint8_t length);
+int AHT21_i2cReadBlocking(i2c_inst_t *i2c_channel, uint8_t address, uint8_t *dst, uint8_t length);
+
+// Non-blocking, one transaction of up to 16 bytes may be queued at a time per bus
+void AHT21_i2cQueueWrite(i2c_inst_t *i2c_channel, uint8_t address, const uint8_t *src, uint8_t length);
+void AHT21_i2cQueueRead(i2c_inst_t *i2c_channel, uint8_t address, uint8_t length);
+bool AHT21_i2cIdle(i2c_inst_t *i2c_channel);
+bool AHT21_i2cAborted(i2c_inst_t *i2c_channel);
+uint8_t AHT21_i2cReadAvailable(i2c_inst_t *i2c_channel);
+void AHT21_i2cCollectRead(i2c_inst_t *i2c_channel, uint8_t *dst, uint8_t length);
+void AHT21_i2cDrain(i2c_inst_t *i2c_channel);
+// Stops the queued transaction if it is still running and drops what it read, the bus is free after
+void AHT21_i2cAbort(i2c_inst_t *i2c_channel);
+
+#endif
@@ -0,0 +1,96 @@
+#include "AHT21_i2c.h"
+#include "trace.h"
+
+uint8_t AHT21_i2cIndex(i2c_inst_t *i2c_channel) {
+    return i2c_hw_index(i2c_channel);
+}
+
+int AHT21_i2cWriteBlocking(i2c_inst_t *i2c_channel, uint8_t address, const uint8_t *src, uint8_t length) {
+    TRACE_BEGIN(TRACE_I2C_TRANSACTION);
+    int result = i2c_write_blocking(i2c_channel, address, src, length, false);
+    TRACE_END(TRACE_I2C_TRANSACTION);
+    return result;
+}
+
+int AHT21_i2cReadBlocking(i2c_inst_t *i2c_channel, uint8_t address, uint8_t *dst, uint8_t length) {
+    TRACE_BEGIN(TRACE_I2C_TRANSACTION);
+    int result = i2c_read_blocking(i2c_channel, address, dst, length, false);
+    TRACE_END(TRACE_I2C_TRANSACTION);
+    return result;
+}
+
+// Every transaction used by the driver fits in the 16 entry FIFO so it is queued at once
+// and the result is collected later. Queued transactions are not traced, they overlap on both
+// buses and their end is only seen when the bus is polled.
+void _AHT21_setTarget(i2c_inst_t *i2c_channel, uint8_t address) {
+    i2c_hw_t *hw = i2c_get_hw(i2c_channel);
+    if (hw->tar != address) {
+        hw->enable = 0;
+        hw->tar = address;
+        hw->enable = 1;
+    }
+}
+
+void AHT21_i2cQueueWrite(i2c_inst_t *i2c_channel, uint8_t address, const uint8_t *src, uint8_t length) {
+    i2c_hw_t *hw = i2c_get_hw(i2c_channel);
+    _AHT21_setTarget(i2c_channel, address);
+
+    for (uint8_t i = 0; i < length; i++) {
+        hw->data_cmd = src[i] | (i == length - 1 ? I2C_IC_DATA_CMD_STOP_BITS : 0);
+    }
+}
+
+void AHT21_i2cQueueRead(i2c_inst_t *i2c_channel, uint8_t address, uint8_t length) {
+    i2c_hw_t *hw = i2c_get_hw(i2c_channel);
+    _AHT21_setTarget(i2c_channel, address);
+
+    for (uint8_t i = 0; i < length; i++) {
+        hw->data_cmd = I2C_IC_DATA_CMD_CMD_BITS | (i == length - 1 ? I2C_IC_DATA_CMD_STOP_BITS : 0);
+    }
+}
+
+bool AHT21_i2cIdle(i2c_inst_t *i2c_channel) {
+    i2c_hw_t *hw = i2c_get_hw(i2c_channel);
+    return hw->txflr == 0 && !(hw->status & I2C_IC_STATUS_ACTIVITY_BITS);
+}
+
+// Returns true and clears the abort if the last queued transaction was not acknowledged
+bool AHT21_i2cAborted(i2c_inst_t *i2c_channel) {
+    i2c_hw_t *hw = i2c_get_hw(i2c_channel);
+    if (hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS) {
+        hw->clr_tx_abrt;
+        return true;
+    }
+    return false;
+}
+
+uint8_t AHT21_i2cReadAvailable(i2c_inst_t *i2c_channel) {
+    return i2c_get_hw(i2c_channel)->rxflr;
+}
+
+void AHT21_i2cCollectRead(i2c_inst_t *i2c_channel, uint8_t *dst, uint8_t length) {
+    i2c_hw_t *hw = i2c_get_hw(i2c_channel);
+    for (uint8_t i = 0; i < length; i++) {
+        dst[i] = (uint8_t) hw->data_cmd;
+    }
+}
+
+void AHT21_i2cDrain(i2c_inst_t *i2c_channel) {
+    i2c_hw_t *hw = i2c_get_hw(i2c_channel);
+    while (hw->rxflr) {
+        hw->data_cmd;
+    }
+}
+
+void AHT21_i2cAbort(i2c_inst_t *i2c_channel) {
+    i2c_hw_t *hw = i2c_get_hw(i2c_channel);
+    if (!AHT21_i2cIdle(i2c_channel)) {
+        // Flushes the TX FIFO and sends a STOP, the bit clears once the bus is released
+        hw->enable |= I2C_IC_ENABLE_ABORT_BITS;
+        while (hw->enable & I2C_IC_ENABLE_ABORT_BITS) {
+            tight_loop_contents();
+        }
+    }
+    hw->clr_tx_abrt;
+    AHT21_i2cDrain(i2c_channel);
+}
@@ -0,0 +1,219 @@
+#include <string.h>
+#include "AHT21.h"
+
+// Stand-in for the i2c blocks and the AHT21 protocol when building with PICO_PLATFORM=host.
+// - 0x71 followed by a 1 byte read returns the status, calibrated bit set
+// - 0xAC 0x33 0x00 starts a conversion, the busy bit stays set for the conversion time
+// - reads return status, 5 data bytes and the CRC-8 of the first 6 bytes
+// - transactions take the time the real bus would take at the configured baudrate
+// - addresses without a sensor are not acknowledged
+// I2C switches are not emulated, sensors behind one must use AHT21_NO_SWITCH here.
+
+#define AHT21_HOST_MAX_SENSORS 32
+#define AHT21_HOST_STATUS_CALIBRATED 0x08
+
+typedef struct AHT21HostSensor {
+    i2c_inst_t *i2c_channel;
+    uint8_t address;
+    bool measuring;
+    uint32_t measureStart;
+    uint8_t data[7];
+} AHT21HostSensor;
+
+struct i2c_inst {
+    uint8_t index;
+    uint baudrate;
+
+    // Queued transaction
+    uint32_t doneTime;
+    bool aborted;
+    uint8_t rx[16];
+    uint8_t rxCount;
+    uint8_t rxRead;
+    uint32_t transactionCount;
+};
+
+struct i2c_inst _hostBuses[2] = {{.index = 0, .baudrate = 100000}, {.index = 1, .baudrate = 100000}};
+i2c_inst_t *i2c0 = &_hostBuses[0];
+i2c_inst_t *i2c1 = &_hostBuses[1];
+
+AHT21HostSensor _hostSensors[AHT21_HOST_MAX_SENSORS];
+uint8_t _hostSensorCount;
+uint32_t _hostConversionUs = 75000;
+
+uint8_t _AHT21_crc8(const uint8_t *data, uint8_t length);
+
+uint i2c_init(i2c_inst_t *i2c, uint baudrate) {
+    i2c->baudrate = baudrate;
+    return baudrate;
+}
+
+/**
+ * @brief Adds an emulated AHT21.
+ *
+ * @param[in] i2c_channel Bus the sensor is on.
+ * @param[in] address Sensor address.
+ * @param[in] humidity Humidity it reports in %.
+ * @param[in] temperature Temperature it reports in C.
+ *
+ * @return false if AHT21_HOST_MAX_SENSORS sensors were already added.
+ */
+bool AHT21_hostAddSensor(i2c_inst_t *i2c_channel, uint8_t address, float humidity, float temperature) {
+    if (_hostSensorCount >= AHT21_HOST_MAX_SENSORS) {
+        return false;
+    }
+
+    AHT21HostSensor *sensor = &_hostSensors[_hostSensorCount++];
+    sensor->i2c_channel = i2c_channel;
+    sensor->address = address;
+    sensor->measuring = false;
+
+    uint32_t rawHumidity = humidity / 100 * (1 << 20);
+    uint32_t rawTemperature = (temperature + 50) / 200 * (1 << 20);
+    sensor->data[0] = AHT21_HOST_STATUS_CALIBRATED;
+    sensor->data[1] = rawHumidity >> 12;
+    sensor->data[2] = rawHumidity >> 4;
+    sensor->data[3] = ((rawHumidity & 0x0F) << 4) | ((rawTemperature >> 16) & 0x0F);
+    sensor->data[4] = rawTemperature >> 8;
+    sensor->data[5] = rawTemperature;
+    sensor->data[6] = _AHT21_crc8(sensor->data, 6);
+    return true;
+}
+
+// Default is 75ms, the datasheet asks to wait 80ms
+void AHT21_hostSetConversionTime(uint32_t conversionUs) {
+    _hostConversionUs = conversionUs;
+}
+
+uint32_t AHT21_hostTransactionCount(i2c_inst_t *i2c_channel) {
+    return i2c_channel->transactionCount;
+}
+
+AHT21HostSensor *_AHT21_hostFindSensor(i2c_inst_t *i2c_channel, uint8_t address) {
+    for (uint8_t i = 0; i < _hostSensorCount; i++) {
+        if (_hostSensors[i].i2c_channel == i2c_channel && _hostSensors[i].address == address) {
+            return &_hostSensors[i];
+        }
+    }
+    return NULL;
+}
+
+// Address byte plus data bytes, 9 clocks each, plus start and stop
+uint32_t _AHT21_hostTransactionUs(i2c_inst_t *i2c_channel, uint8_t length) {
+    return ((1 + length) * 9 + 2) * 1000000ull / i2c_channel->baudrate;
+}
+
+bool _AHT21_hostWrite(i2c_inst_t *i2c_channel, uint8_t address, const uint8_t *src, uint8_t length) {
+    i2c_channel->transactionCount++;
+    i2c_channel->rxCount = 0;
+    i2c_channel->rxRead = 0;
+    i2c_channel->doneTime = time_us_32() + _AHT21_hostTransactionUs(i2c_channel, length);
+
+    AHT21HostSensor *sensor = _AHT21_hostFindSensor(i2c_channel, address);
+    if (sensor == NULL) {
+        return false;
+    }
+
+    if (length == 3 && src[0] == 0xAC && src[1] == 0x33 && src[2] == 0x00) {
+        sensor->measuring = true;
+        sensor->measureStart = time_us_32();
+    }
+    return true;
+}
+
+bool _AHT21_hostRead(i2c_inst_t *i2c_channel, uint8_t address, uint8_t length) {
+    i2c_channel->transactionCount++;
+    i2c_channel->rxCount = 0;
+    i2c_channel->rxRead = 0;
+    i2c_channel->doneTime = time_us_32() + _AHT21_hostTransactionUs(i2c_channel, length);
+
+    AHT21HostSensor *sensor = _AHT21_hostFindSensor(i2c_channel, address);
+    if (sensor == NULL) {
+        return false;
+    }
+
+    uint8_t status = AHT21_HOST_STATUS_CALIBRATED;
+    if (sensor->measuring && time_us_32() - sensor->measureStart < _hostConversionUs) {
+        status |= AHT21_STATUS_BUSY;
+    } else {
+        sensor->measuring = false;
+    }
+
+    // The real sensor keeps the last result around while busy, the CRC covers the status byte
+    memcpy(i2c_channel->rx, sensor->data, 7);
+    i2c_channel->rx[0] = status;
+    i2c_channel->rx[6] = _AHT21_crc8(i2c_channel->rx, 6);
+    i2c_channel->rxCount = length < 7 ? length : 7;
+    return true;
+}
+
+void _AHT21_hostWaitDone(i2c_inst_t *i2c_channel) {
+    while ((int32_t) (time_us_32() - i2c_channel->doneTime) < 0) {
+        tight_loop_contents();
+    }
+}
+
+uint8_t AHT21_i2cIndex(i2c_inst_t *i2c_channel) {
+    return i2c_channel->index;
+}
+
+int AHT21_i2cWriteBlocking(i2c_inst_t *i2c_channel, uint8_t address, const uint8_t *src, uint8_t length) {
+    bool acknowledged = _AHT21_hostWrite(i2c_channel, address, src, length);
+    _AHT21_hostWaitDone(i2c_channel);
+    return acknowledged ? length : PICO_ERROR_GENERIC;
+}
+
+int AHT21_i2cReadBlocking(i2c_inst_t *i2c_channel, uint8_t address, uint8_t *dst, uint8_t length) {
+    bool acknowledged = _AHT21_hostRead(i2c_channel, address, length);
+    _AHT21_hostWaitDone(i2c_channel);
+    if (!acknowledged) {
+        return PICO_ERROR_GENERIC;
+    }
+
+    AHT21_i2cCollectRead(i2c_channel, dst, length);
+    return length;
+}
+
+void AHT21_i2cQueueWrite(i2c_inst_t *i2c_channel, uint8_t address, const uint8_t *src, uint8_t length) {
+    i2c_channel->aborted = !_AHT21_hostWrite(i2c_channel, address, src, length);
+}
+
+void AHT21_i2cQueueRead(i2c_inst_t *i2c_channel, uint8_t address, uint8_t length) {
+    i2c_channel->aborted = !_AHT21_hostRead(i2c_channel, address, length);
+}
+
+bool AHT21_i2cIdle(i2c_inst_t *i2c_channel) {
+    return (int32_t) (time_us_32() - i2c_channel->doneTime) >= 0;
+}
+
+bool AHT21_i2cAborted(i2c_inst_t *i2c_channel) {
+    bool aborted = i2c_channel->aborted && AHT21_i2cIdle(i2c_channel);
+    if (aborted) {
+        i2c_channel->aborted = false;
+    }
+    return aborted;
+}
+
+uint8_t AHT21_i2cReadAvailable(i2c_inst_t *i2c_channel) {
+    if (!AHT21_i2cIdle(i2c_channel)) {
+        return 0;
+    }
+    return i2c_channel->rxCount - i2c_channel->rxRead;
+}
+
+void AHT21_i2cCollectRead(i2c_inst_t *i2c_channel, uint8_t *dst, uint8_t length) {
+    for (uint8_t i = 0; i < length; i++) {
+        dst[i] = i2c_channel->rx[i2c_channel->rxRead++];
+    }
+}
+
+void AHT21_i2cDrain(i2c_inst_t *i2c_channel) {
+    i2c_channel->rxRead = i2c_channel->rxCount;
+}
+
+// The emulated bus is released right away
+void AHT21_i2cAbort(i2c_inst_t *i2c_channel) {
+    i2c_channel->doneTime = time_us_32();
+    i2c_channel->aborted = false;
+    AHT21_i2cDrain(i2c_channel);
+}
@@ -0,0 +1,392 @@
+/**
+ * @brief Benchmark firmware, runs every library through fixed scenarios and prints the results.
+ *
+ * *** Output ***
+ * - One JSON object per line on stdio, the first one is "start" with the platform and clock, the
+ *   last one is "end".
+ * - Every result has the scenario name, its parameters, the number of samples, min/avg/max time
+ *   per operation and one headline value with its unit and whether lower or higher is better.
+ * - tools/benchmark_compare.py captures the lines from a file or the serial port, saves them and
+ *   compares them against a baseline run.
+ *
+ * *** Scenarios ***
+ * - flash_lib: format, init, lookup, page program and logical sector erase for every GROUP_BY_*.
+ * - 744051: scan rate of one IC, with averaging and settling, and of three ICs.
+ * - Shift registers: blocking byte and word writes and DMA writes at several clocks and chain
+ *   lengths, pins 10 (data), 11 (clock) and 12 (latch).
+ * - AHT21: status read and full measurement round trip on i2c0, pins 4 and 5. Skipped when no
+ *   sensor answers.
+ *
+ * *** Host ***
+ * - Built with PICO_PLATFORM=host the same scenarios run against the stand-ins: flash in memory
+ *   with the typical chip times, the ADC with its conversion time and an emulated AHT21.
+ * - Shift registers need the PIO and DMA, they are reported as skipped on host.
+ *
+ * *** Note ***
+ * - Physical sectors BENCHMARK_FLASH_LOWER_BOUND to BENCHMARK_FLASH_LOWER_BOUND + 63 are erased
+ *   and rewritten, keep them clear of the program and of any data worth keeping.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "flash_lib.h"
+#include "flash_lib_flash.h"
+#include "744051.h"
+#include "AHT21.h"
+#include "trace.h"
+
+#if PICO_ON_DEVICE
+#include "hardware/clocks.h"
+#include "shift_register.h"
+#endif
+
+#define BENCHMARK_VERSION 1
+
+// 1MB into the flash, past the program and inside the smallest 2MB flash
+#define BENCHMARK_FLASH_LOWER_BOUND 256
+#define BENCHMARK_FLASH_SECTORS 64
+
+typedef struct BenchmarkTimer {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t start;
+} BenchmarkTimer;
+
+void _benchmark_reset(BenchmarkTimer *timer) {
+    memset(timer, 0, sizeof(BenchmarkTimer));
+    timer->min = UINT32_MAX;
+}
+
+void _benchmark_add(BenchmarkTimer *timer, uint32_t elapsed) {
+    timer->count++;
+    timer->sum += elapsed;
+    timer->min = MIN(timer->min, elapsed);
+    timer->max = MAX(timer->max, elapsed);
+}
+
+void _benchmark_start(BenchmarkTimer *timer) {
+    timer->start = time_us_32();
+}
+
+void _benchmark_stop(BenchmarkTimer *timer) {
+    _benchmark_add(timer, time_us_32() - timer->start);
+}
+
+float _benchmark_average(BenchmarkTimer *timer, uint32_t batch) {
+    return timer->count == 0 ? 0 : (float) timer->sum / timer->count / batch;
+}
+
+/**
+ * @brief Prints one result line.
+ *
+ * @param name Scenario name.
+ * @param params JSON members describing the scenario, without braces.
+ * @param timer Samples, every sample timed batch operations.
+ * @param batch Operations per sample, min/avg/max are per operation.
+ * @param value Headline value compared between runs.
+ * @param unit Unit of value.
+ * @param higherIsBetter False when value is a time, true when it is a rate.
+ */
+void _benchmark_report(const char *name, const char *params, BenchmarkTimer *timer, uint32_t batch, float value, const char *unit, bool higherIsBetter) {
+    printf("{\"name\":\"%s\",\"params\":{%s},\"samples\":%u,\"min_us\":%.3f,\"avg_us\":%.3f,\"max_us\":%.3f,\"value\":%.3f,\"unit\":\"%s\",\"better\":\"%s\"}\n",
+           name, params, timer->count * batch, (float) timer->min / batch, _benchmark_average(timer, batch), (float) timer->max / batch,
+           value, unit, higherIsBetter ? "higher" : "lower");
+}
+
+void _benchmark_skip(const char *name, const char *reason) {
+    printf("{\"name\":\"%s\",\"params\":{},\"skipped\":\"%s\"}\n", name, reason);
+}
+
+// Rewrites the whole benchmark region so every run starts from blank flash
+void _benchmark_flash_wipe() {
+    uint32_t irqStatus = save_and_disable_interrupts();
+    flash_range_erase(BENCHMARK_FLASH_LOWER_BOUND * FLASH_SECTOR_SIZE, BENCHMARK_FLASH_SECTORS * FLASH_SECTOR_SIZE);
+    restore_interrupts(irqStatus);
+}
+
+void _benchmark_flash(uint8_t groupBy) {
+    uint16_t logicalCount = BENCHMARK_FLASH_SECTORS / groupBy;
+    char params[48];
+    snprintf(params, sizeof(params), "\"group_by\":%u,\"logical_sectors\":%u", groupBy, logicalCount);
+    BenchmarkTimer timer;
+
+    // First init writes a header to every logical sector
+    _benchmark_flash_wipe();
+    _benchmark_reset(&timer);
+    _benchmark_start(&timer);
+    init_flash_lib(BENCHMARK_FLASH_LOWER_BOUND, logicalCount, groupBy);
+    _benchmark_stop(&timer);
+    _benchmark_report("flash_format", params, &timer, 1, _benchmark_average(&timer, 1) / 1000, "ms", false);
+
+    // Later inits only validate the headers
+    _benchmark_reset(&timer);
+    for (uint8_t i = 0; i < 10; i++) {
+        _benchmark_start(&timer);
+        init_flash_lib(BENCHMARK_FLASH_LOWER_BOUND, logicalCount, groupBy);
+        _benchmark_stop(&timer);
+    }
+    _benchmark_report("flash_init", params, &timer, 1, _benchmark_average(&timer, 1), "us", false);
+
+    // Every lookup scans the headers, batched since one can take less than a microsecond
+    _benchmark_reset(&timer);
+    for (uint8_t i = 0; i < 20; i++) {
+        _benchmark_start(&timer);
+        for (uint16_t id = 0; id < logicalCount; id++) {
+            read_sector(id, 0);
+        }
+        _benchmark_stop(&timer);
+    }
+    _benchmark_report("flash_lookup", params, &timer, logicalCount, _benchmark_average(&timer, logicalCount), "us", false);
+
+    // Pages 1 to 15 of the first physical sector, page 0 is the header
+    uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xA5, sizeof(page));
+    uint16_t testedSectors = MIN(logicalCount, 4);
+    _benchmark_reset(&timer);
+    for (uint16_t id = 0; id < testedSectors; id++) {
+        for (uint32_t p = 1; p < FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE; p++) {
+            _benchmark_start(&timer);
+            write_sector_page(id, p * FLASH_PAGE_SIZE, page);
+            _benchmark_stop(&timer);
+        }
+    }
+    _benchmark_report("flash_program", params, &timer, 1, _benchmark_average(&timer, 1), "us", false);
+
+    _benchmark_reset(&timer);
+    for (uint16_t id = 0; id < testedSectors; id++) {
+        _benchmark_start(&timer);
+        erase_logical_sector(id);
+        _benchmark_stop(&timer);
+    }
+    _benchmark_report("flash_erase", params, &timer, 1, _benchmark_average(&timer, 1) / 1000, "ms", false);
+}
+
+void _benchmark_744051_scan(const char *params, C744051 *c744051, uint8_t icCount, uint8_t samples, bool extraPrecision) {
+    uint16_t data[24];
+    BenchmarkTimer timer;
+    _benchmark_reset(&timer);
+    for (uint8_t i = 0; i < 100; i++) {
+        _benchmark_start(&timer);
+        for (uint8_t j = 0; j < 10; j++) {
+            if (icCount == 1) {
+                read_744051_masked(c744051[0], 0xFF, samples, data, extraPrecision);
+            } else {
+                read_multiple_744051(c744051, icCount, samples, data, extraPrecision);
+            }
+        }
+        _benchmark_stop(&timer);
+    }
+    _benchmark_report("744051_scan", params, &timer, 10, 1000000 / _benchmark_average(&timer, 10), "scans/s", true);
+}
+
+void _benchmark_744051() {
+    init_744051_adc();
+    C744051 c744051[3];
+    init_744051(&c744051[0], 26, 13, 10, 11, 12);
+    init_744051(&c744051[1], 26, 14, 10, 11, 12);
+    init_744051(&c744051[2], 28, NO_DISABLE_PIN, 10, 11, 12);
+
+    _benchmark_744051_scan("\"ics\":1,\"samples\":1,\"extra_precision\":false", c744051, 1, 1, false);
+    _benchmark_744051_scan("\"ics\":1,\"samples\":4,\"extra_precision\":false", c744051, 1, 4, false);
+    _benchmark_744051_scan("\"ics\":1,\"samples\":1,\"extra_precision\":true", c744051, 1, 1, true);
+    _benchmark_744051_scan("\"ics\":3,\"samples\":1,\"extra_precision\":false", c744051, 3, 1, false);
+}
+
+#if PICO_ON_DEVICE
+const float _benchmarkShiftClocks[] = {1000000, 10000000, 41666000};
+const uint16_t _benchmarkShiftChains[] = {1, 8, 64};
+
+// Bits per microsecond of one write, turned into kbit/s
+float _benchmark_shift_rate(ShiftRegister *shiftRegister, BenchmarkTimer *timer, uint32_t batch) {
+    return shiftRegister->registerCount * 8 * 1000 / _benchmark_average(timer, batch);
+}
+
+void _benchmark_shift_register() {
+    PIO pio = pio0;
+    uint offset = pio_add_program(pio, &shift_register_program);
+    uint latchOffset = pio_add_program(pio, &shift_register_latch_program);
+
+    ShiftRegister shiftRegister;
+    memset(&shiftRegister, 0, sizeof(ShiftRegister));
+    shiftRegister.pio = pio;
+    shiftRegister.sm = pio_claim_unused_sm(pio, true);
+    shiftRegister.dataPin = 10;
+    shiftRegister.clockPin = 11;
+    shiftRegister.updateData = 12;
+
+    // Enough for the longest chain
+    static uint8_t data[64];
+    memset(data, 0x5A, sizeof(data));
+
+    char params[64];
+    BenchmarkTimer timer;
+    for (uint8_t c = 0; c < count_of(_benchmarkShiftClocks); c++) {
+        float clock = _benchmarkShiftClocks[c];
+
+        for (uint8_t n = 0; n < count_of(_benchmarkShiftChains); n++) {
+            shiftRegister.registerCount = _benchmarkShiftChains[n];
+
+            for (uint8_t fifoBits = 8; fifoBits <= 32; fifoBits += 24) {
+                if (fifoBits == 8) {
+                    init_out_shift_register(&shiftRegister, offset, clock);
+                } else {
+                    init_out_shift_register_words(&shiftRegister, offset, clock);
+                }
+                snprintf(params, sizeof(params), "\"clock_hz\":%.0f,\"registers\":%u,\"mode\":\"%s\"", clock, shiftRegister.registerCount, fifoBits == 8 ? "byte" : "word");
+
+                _benchmark_reset(&timer);
+                for (uint8_t i = 0; i < 20; i++) {
+                    _benchmark_start(&timer);
+                    for (uint8_t j = 0; j < 10; j++) {
+                        write_to_shift_register(&shiftRegister, data);
+                    }
+                    _benchmark_stop(&timer);
+                }
+                _benchmark_report("shift_register_write", params, &timer, 10, _benchmark_shift_rate(&shiftRegister, &timer, 10), "kbit/s", true);
+            }
+        }
+
+        pio_sm_set_enabled(pio, shiftRegister.sm, false);
+
+        for (uint8_t n = 0; n < count_of(_benchmarkShiftChains); n++) {
+            // The DMA buffer is sized for registerCount at init
+            shiftRegister.registerCount = _benchmarkShiftChains[n];
+            if (!init_out_shift_register_dma_words(&shiftRegister, latchOffset, clock, NULL)) {
+                _benchmark_skip("shift_register_write", "no memory for the DMA buffer");
+                _benchmark_skip("shift_register_dma_start", "no memory for the DMA buffer");
+                continue;
+            }
+            snprintf(params, sizeof(params), "\"clock_hz\":%.0f,\"registers\":%u,\"mode\":\"dma\"", clock, shiftRegister.registerCount);
+
+            // Until latched
+            _benchmark_reset(&timer);
+            for (uint8_t i = 0; i < 20; i++) {
+                _benchmark_start(&timer);
+                for (uint8_t j = 0; j < 10; j++) {
+                    write_to_shift_register_dma(&shiftRegister, data);
+                    wait_for_shift_register_dma(&shiftRegister);
+                }
+                _benchmark_stop(&timer);
+            }
+            _benchmark_report("shift_register_write", params, &timer, 10, _benchmark_shift_rate(&shiftRegister, &timer, 10), "kbit/s", true);
+
+            // CPU time to start a transfer, the rest runs on the DMA
+            _benchmark_reset(&timer);
+            for (uint8_t i = 0; i < 100; i++) {
+                wait_for_shift_register_dma(&shiftRegister);
+                _benchmark_start(&timer);
+                write_to_shift_register_dma(&shiftRegister, data);
+                _benchmark_stop(&timer);
+            }
+            _benchmark_report("shift_register_dma_start", params, &timer, 1, _benchmark_average(&timer, 1), "us", false);
+            deinit_shift_register_dma(&shiftRegister);
+        }
+    }
+
+    pio_sm_unclaim(pio, shiftRegister.sm);
+    pio_remove_program(pio, &shift_register_program, offset);
+    pio_remove_program(pio, &shift_register_latch_program, latchOffset);
+}
+#endif
+
+void _benchmark_aht21_done(AHT21 *aht21, void *userData) {
+    BenchmarkTimer *timer = (BenchmarkTimer *) userData;
+    if (aht21->measurement.status == AHT21_OK) {
+        _benchmark_add(timer, aht21->measurement.duration);
+    }
+}
+
+void _benchmark_aht21() {
+#if !PICO_ON_DEVICE
+    AHT21_hostAddSensor(i2c0, AHT21_ADDRESS, 45.0f, 22.5f);
+#endif
+    i2c_init(i2c0, 400000);
+    gpio_set_function(4, GPIO_FUNC_I2C);
+    gpio_set_function(5, GPIO_FUNC_I2C);
+    gpio_pull_up(4);
+    gpio_pull_up(5);
+    sleep_ms(100);
+
+    uint8_t status;
+    if (AHT21_i2cReadBlocking(i2c0, AHT21_ADDRESS, &status, 1) < 0) {
+        _benchmark_skip("aht21_status_read", "no sensor on i2c0");
+        _benchmark_skip("aht21_measurement", "no sensor on i2c0");
+        return;
+    }
+
+    AHT21 aht21;
+    AHT21_init(&aht21, i2c0, AHT21_ADDRESS, AHT21_NO_SWITCH, 0);
+    const char *params = "\"bus\":0,\"baudrate\":400000";
+    BenchmarkTimer timer;
+
+    _benchmark_reset(&timer);
+    for (uint8_t i = 0; i < 50; i++) {
+        _benchmark_start(&timer);
+        AHT21_i2cReadBlocking(i2c0, AHT21_ADDRESS, &status, 1);
+        _benchmark_stop(&timer);
+    }
+    _benchmark_report("aht21_status_read", params, &timer, 1, _benchmark_average(&timer, 1), "us", false);
+
+    // Start to result, measurements back to back
+    AHT21Fleet fleet;
+    AHT21 *sensors[1] = {&aht21};
+    _benchmark_reset(&timer);
+    if (!AHT21_startFleetPolled(&fleet, sensors, 1, 0, _benchmark_aht21_done, &timer)) {
+        _benchmark_skip("aht21_measurement", "no memory for the fleet");
+        return;
+    }
+    uint32_t start = time_us_32();
+    while (fleet.measurementCount < 10 && time_us_32() - start < 5000000) {
+        AHT21_pollFleet(&fleet);
+    }
+    AHT21_stopFleet(&fleet);
+
+    if (timer.count == 0) {
+        _benchmark_skip("aht21_measurement", "no successful measurement");
+        return;
+    }
+    _benchmark_report("aht21_measurement", params, &timer, 1, _benchmark_average(&timer, 1) / 1000, "ms", false);
+}
+
+int main() {
+    stdio_init_all();
+    init_trace();
+
+#if PICO_ON_DEVICE
+    // Time to open the serial port
+    sleep_ms(2000);
+    printf("{\"name\":\"start\",\"platform\":\"rp2040\",\"clock_hz\":%u,\"version\":%u}\n", clock_get_hz(clk_sys), BENCHMARK_VERSION);
+#else
+    printf("{\"name\":\"start\",\"platform\":\"host\",\"clock_hz\":0,\"version\":%u}\n", BENCHMARK_VERSION);
+#endif
+    uint32_t start = time_us_32();
+
+    const uint8_t groupBys[] = {GROUP_BY_1, GROUP_BY_8, GROUP_BY_16, GROUP_BY_64};
+    for (uint8_t i = 0; i < count_of(groupBys); i++) {
+        _benchmark_flash(groupBys[i]);
+    }
+
+    _benchmark_744051();
+
+#if PICO_ON_DEVICE
+    _benchmark_shift_register();
+#else
+    _benchmark_skip("shift_register_write", "PIO and DMA are not emulated on host");
+    _benchmark_skip("shift_register_dma_start", "PIO and DMA are not emulated on host");
+#endif
+
+    _benchmark_aht21();
+
+    printf("{\"name\":\"end\",\"duration_ms\":%u}\n", (time_us_32() - start) / 1000);
+
+#if PICO_ON_DEVICE
+    while (true) {
+        sleep_ms(1000);
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+"""Collects the results printed by the benchmark firmware and compares them against a baseline.
+
+The firmware prints one JSON object per line, from "start" to "end". Other lines are ignored.
+
+    python3 benchmark_compare.py /dev/ttyACM0 --save results.jsonl
+    python3 benchmark_compare.py results.jsonl --baseline baseline.jsonl --tolerance 10
+    ./PicoLibrariesBenchmark | python3 benchmark_compare.py - --baseline host_baseline.jsonl
+
+A result is a regression when its value is worse than the baseline by more than --tolerance
+percent. The exit code is 1 if any result regressed or a baseline result is missing from this run,
+and 2 if the run did not finish or was made on another platform than the baseline, so the
+comparison can gate a build.
+"""
+
+import argparse
+import json
+import sys
+import time
+
+
+def read_lines(path, seconds):
+    if path == "-":
+        yield from sys.stdin
+        return
+    if not path.startswith("/dev/") and not path.upper().startswith("COM"):
+        with open(path) as file:
+            yield from file
+        return
+
+    import serial  # pyserial, only needed to capture straight from the board
+
+    with serial.Serial(path, timeout=0.1) as port:
+        deadline = time.time() + seconds
+        pending = b""
+        while time.time() < deadline:
+            pending += port.read(4096)
+            *lines, pending = pending.split(b"\n")
+            for line in lines:
+                yield line.decode("ascii", "replace")
+
+
+def read_results(path, seconds):
+    """Returns the start line, the results and whether the end line was seen."""
+    start = None
+    results = []
+    ended = False
+    for line in read_lines(path, seconds):
+        line = line.strip()
+        if not line.startswith("{"):
+            continue
+        try:
+            entry = json.loads(line)
+        except ValueError:
+            continue
+        name = entry.get("name")
+        if name == "start":
+            start = entry
+            results = []
+        elif name == "end":
+            ended = start is not None
+            break
+        elif name:
+            results.append(entry)
+    return start, results, ended
+
+
+def key(entry):
+    params = ",".join("%s=%s" % item for item in sorted(entry.get("params", {}).items()))
+    return "%s(%s)" % (entry["name"], params)
+
+
+def change(entry, base):
+    """Percent change, positive is better."""
+    if not base["value"]:
+        return 0.0
+    percent = (entry["value"] - base["value"]) / base["value"] * 100
+    return percent if entry["better"] == "higher" else -percent
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="capture file, serial port or - for stdin")
+    parser.add_argument("--seconds", type=float, default=600, help="longest time to wait on a serial port")
+    parser.add_argument("--baseline", help="results of a previous run, as written by --save")
+    parser.add_argument("--tolerance", type=float, default=5.0, help="allowed loss in percent")
+    parser.add_argument("--save", help="write the results as JSON lines")
+    args = parser.parse_args()
+
+    start, results, ended = read_results(args.input, args.seconds)
+    if start is None:
+        print("no benchmark output found", file=sys.stderr)
+        return 2
+
+    if args.save:
+        with open(args.save, "w") as file:
+            for entry in [start] + results:
+                file.write(json.dumps(entry) + "\n")
+
+    if not ended:
+        print("the run stopped before its end line, %d result(s) read" % len(results), file=sys.stderr)
+        return 2
+
+    baseline = {}
+    if args.baseline:
+        base_start, base_results, _ = read_results(args.baseline, args.seconds)
+        if base_start is None:
+            print("no benchmark output found in the baseline", file=sys.stderr)
+            return 2
+        if base_start.get("platform") != start.get("platform"):
+            print("baseline is from %s, this run from %s, not comparable"
+                  % (base_start.get("platform"), start.get("platform")), file=sys.stderr)
+            return 2
+        baseline = {key(entry): entry for entry in base_results if "value" in entry}
+
+    print("%s, clock %s Hz" % (start.get("platform"), start.get("clock_hz")))
+    regressions = 0
+    width = max([len(key(entry)) for entry in results] + [10])
+    for entry in results:
+        name = key(entry)
+        if "skipped" in entry:
+            print("%-*s  skipped: %s" % (width, name, entry["skipped"]))
+            continue
+
+        line = "%-*s  %12.3f %-8s" % (width, name, entry["value"], entry["unit"])
+        base = baseline.get(name)
+        if base is not None:
+            percent = change(entry, base)
+            status = "ok"
+            if percent < -args.tolerance:
+                status = "REGRESSION"
+                regressions += 1
+            elif percent > args.tolerance:
+                status = "improved"
+            line += "  baseline %12.3f  %+7.1f%%  %s" % (base["value"], percent, status)
+        elif baseline:
+            line += "  new"
+        print(line)
+
+    missing = sorted(set(baseline) - {key(entry) for entry in results})
+    for name in missing:
+        print("%-*s  missing from this run" % (width, name))
+
+    if regressions:
+        print("%d regression(s) over %.1f%%" % (regressions, args.tolerance), file=sys.stderr)
+    if missing:
+        print("%d baseline result(s) missing from this run" % len(missing), file=sys.stderr)
+    return 1 if regressions or missing else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
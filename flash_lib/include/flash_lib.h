@@ -56,6 +56,15 @@
 #define GROUP_BY_16 16
 #define GROUP_BY_64 64
 
+typedef void (*FlashLibHook)(void);
+
+void init_flash_lib(uint32_t lower_bound, uint16_t logical_sectors_count, uint8_t group_by);
+uint8_t * read_sector(uint16_t logical_sector, uint32_t offset_bytes);
+void write_sector_page(uint16_t logical_sector, uint32_t offset_bytes, const uint8_t *data);
+void erase_logical_sector(uint16_t logical_sector);
+void erase_physical_sector(uint16_t logical_sector, uint8_t physical_sector_id);
+uint32_t get_logical_sector_size();
+void set_flash_lib_hooks(FlashLibHook before, FlashLibHook after);
 void flash_lib_example();
 
 #endif
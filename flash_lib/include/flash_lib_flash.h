@@ -0,0 +1,31 @@
+#ifndef FLASH_LIB_FLASH_H
+#define FLASH_LIB_FLASH_H
+
+#include "pico/stdlib.h"
+
+// Flash used by flash_lib.
+// On device this is the SDK flash API and XIP, host/flash_lib_flash_host.c emulates the flash
+// chip in memory so the library can run on PICO_PLATFORM=host.
+#if PICO_ON_DEVICE
+#include "hardware/flash.h"
+#else
+#define FLASH_PAGE_SIZE (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+#define FLASH_BLOCK_SIZE (1u << 16)
+
+#ifndef PICO_FLASH_SIZE_BYTES
+#define PICO_FLASH_SIZE_BYTES (4 * 1024 * 1024)
+#endif
+
+// Reads go straight to the emulated flash, like XIP_BASE + offset on the device
+#define XIP_BASE ((uintptr_t) flash_lib_host_image())
+
+uint8_t *flash_lib_host_image();
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count);
+
+// Erase/program times, defaults are the typical W25Q16JV times, 0 makes them instant
+void flash_lib_host_set_timing(uint32_t sectorEraseUs, uint32_t blockEraseUs, uint32_t pageProgramUs);
+#endif
+
+#endif
@@ -2,9 +2,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
-#include "hardware/flash.h"
+#include "flash_lib_flash.h"
 #include "hardware/sync.h"
 #include "flash_lib.h"
+#include "trace.h"
 
 #define MEMORY_SIGNATURE 0x27062021
 #define SIGNATURE_SIZE_BYTES 4
@@ -25,6 +26,9 @@ uint32_t _upper_bound;
 uint16_t _logical_sectors_count;
 uint8_t _group_by;
 
+FlashLibHook _flash_before_hook;
+FlashLibHook _flash_after_hook;
+
 uint16_t _get_random_physical_sector();
 uint8_t * get_sector_read_pointer(uint32_t physical_sector_address);
 void init_sectors();
@@ -56,6 +60,46 @@ void init_flash_lib(uint32_t lower_bound, uint16_t logical_sectors_count, uint8_
     init_sectors();
 }
 
+/**
+ * @brief Sets functions called around every flash erase/program.
+ *
+ * The before hook runs with interrupts still enabled, it is where the other core is told to stop
+ * running code from flash. Both hooks must be in RAM. Pass NULL to remove them.
+ *
+ * @param before Called before the flash is touched.
+ * @param after Called once the flash can be read again.
+ */
+void set_flash_lib_hooks(FlashLibHook before, FlashLibHook after) {
+    _flash_before_hook = before;
+    _flash_after_hook = after;
+}
+
+uint32_t _flash_lib_lock() {
+    if (_flash_before_hook != NULL) {
+        _flash_before_hook();
+    }
+    return save_and_disable_interrupts();
+}
+
+void _flash_lib_unlock(uint32_t irq_status) {
+    restore_interrupts(irq_status);
+    if (_flash_after_hook != NULL) {
+        _flash_after_hook();
+    }
+}
+
+void _flash_lib_erase(uint32_t memory_addr, size_t count) {
+    TRACE_BEGIN(TRACE_FLASH_ERASE);
+    flash_range_erase(memory_addr, count);
+    TRACE_END(TRACE_FLASH_ERASE);
+}
+
+void _flash_lib_program(uint32_t memory_addr, const uint8_t *data, size_t count) {
+    TRACE_BEGIN(TRACE_FLASH_PROGRAM);
+    flash_range_program(memory_addr, data, count);
+    TRACE_END(TRACE_FLASH_PROGRAM);
+}
+
 /**
  * @brief Initializes flash memory sectors during startup.
  * 
@@ -99,15 +143,19 @@ void init_sectors() {
             continue;
         }
 
-        // Allocates new physical sector for the logical id
-        SectorHeader sectorHeader = {
-            .signature = MEMORY_SIGNATURE,
-            .logicalID = logical_id,
-            .writeCount = 1,
-        };
-        uint8_t headerBuffer[FLASH_PAGE_SIZE];
-        prepare_buffer_to_write(headerBuffer, &sectorHeader, sizeof(SectorHeader));
-        _write_sector_by_physical_addr(_get_random_physical_sector(), headerBuffer);
+        // Allocates a free group of physical sectors for the logical id, each one with its own header
+        uint16_t first_physical_sector = _get_random_physical_sector();
+        for (uint8_t i = 0; i < _group_by; ++i) {
+            SectorHeader sectorHeader = {
+                .signature = MEMORY_SIGNATURE,
+                .logicalID = logical_id,
+                .writeCount = 1,
+                .id = i,
+            };
+            uint8_t headerBuffer[FLASH_PAGE_SIZE];
+            prepare_buffer_to_write(headerBuffer, &sectorHeader, sizeof(SectorHeader));
+            _write_sector_by_physical_addr(first_physical_sector + i, headerBuffer);
+        }
 
         // Finished initializing all sectors
         unitialized_sectors_count--;
@@ -122,58 +170,92 @@ uint8_t * read_sector(uint16_t logical_sector, uint32_t offset_bytes) {
     uint32_t physical_sector_id = offset_bytes / FLASH_SECTOR_SIZE;
     uint32_t physical_sector_offset = offset_bytes % FLASH_SECTOR_SIZE;
     get_physical_sector_from_logical_id(logical_sector, physical_sector_id, &physical_sector_address);
-    return (uint8_t *) (get_memory_addr_from_physical_sector(physical_sector_address + physical_sector_offset) + XIP_BASE);
+    return (uint8_t *) (get_memory_addr_from_physical_sector(physical_sector_address) + physical_sector_offset + XIP_BASE);
+}
+
+/**
+ * @brief Programs one page of a logical sector, the page must have been erased before.
+ *
+ * The first page of every physical sector holds the header and can't be written.
+ *
+ * @param logical_sector Logical sector to write to.
+ * @param offset_bytes Offset inside the logical sector, must be a multiple of FLASH_PAGE_SIZE.
+ * @param data FLASH_PAGE_SIZE bytes to program.
+ */
+void write_sector_page(uint16_t logical_sector, uint32_t offset_bytes, const uint8_t *data) {
+    assert(logical_sector < _logical_sectors_count);
+    assert(offset_bytes % FLASH_PAGE_SIZE == 0);
+    assert(offset_bytes % FLASH_SECTOR_SIZE != 0);
+
+    uint32_t physical_sector_address;
+    uint32_t physical_sector_id = offset_bytes / FLASH_SECTOR_SIZE;
+    uint32_t physical_sector_offset = offset_bytes % FLASH_SECTOR_SIZE;
+    get_physical_sector_from_logical_id(logical_sector, physical_sector_id, &physical_sector_address);
+    uint32_t memory_addr = get_memory_addr_from_physical_sector(physical_sector_address) + physical_sector_offset;
+
+    uint32_t irq_status = _flash_lib_lock();
+
+    _flash_lib_program(memory_addr, data, FLASH_PAGE_SIZE);
+
+    _flash_lib_unlock(irq_status);
+}
+
+uint32_t get_logical_sector_size() {
+    return FLASH_SECTOR_SIZE * _group_by;
 }
 
 void erase_logical_sector(uint16_t logical_sector) {
     assert(logical_sector < _logical_sectors_count);
 
-    uint32_t irq_status = save_and_disable_interrupts();
+    uint32_t irq_status = _flash_lib_lock();
 
     SectorHeader *sectorHeaders = (SectorHeader *) malloc(_group_by * sizeof(SectorHeader));
+    uint32_t *physical_sector_addresses = (uint32_t *) malloc(_group_by * sizeof(uint32_t));
 
+    // Addresses are kept, the headers can't be looked up once erased
     for (uint8_t i = 0; i < _group_by; ++i) {
-        uint32_t physical_sector_address;
-        get_physical_sector_from_logical_id(logical_sector, i, &physical_sector_address);
-        read_and_update_header(physical_sector_address, &sectorHeaders[i]);
+        get_physical_sector_from_logical_id(logical_sector, i, &physical_sector_addresses[i]);
+        read_and_update_header(physical_sector_addresses[i], &sectorHeaders[i]);
     }
 
     uint32_t physical_sector_address;
     get_first_sector_from_logical_id(logical_sector, &physical_sector_address);
     uint32_t memory_addr = get_memory_addr_from_physical_sector(physical_sector_address);
-    flash_range_erase(memory_addr, FLASH_SECTOR_SIZE * _group_by);
+    _flash_lib_erase(memory_addr, FLASH_SECTOR_SIZE * _group_by);
 
     for (uint8_t i = 0; i < _group_by; ++i) {
         uint8_t headerBuffer[FLASH_PAGE_SIZE];
         prepare_buffer_to_write(headerBuffer, &sectorHeaders[i], sizeof(SectorHeader));
 
-        get_physical_sector_from_logical_id(logical_sector, i, &physical_sector_address);
-        memory_addr = get_memory_addr_from_physical_sector(physical_sector_address);
-        flash_range_program(memory_addr, headerBuffer, FLASH_PAGE_SIZE);
+        memory_addr = get_memory_addr_from_physical_sector(physical_sector_addresses[i]);
+        _flash_lib_program(memory_addr, headerBuffer, FLASH_PAGE_SIZE);
     }
 
     free(sectorHeaders);
-    restore_interrupts(irq_status);
+    free(physical_sector_addresses);
+    _flash_lib_unlock(irq_status);
 }
 
 void erase_physical_sector(uint16_t logical_sector, uint8_t physical_sector_id) {
     assert(logical_sector < _logical_sectors_count);
     assert(physical_sector_id < _group_by);
 
-    uint32_t irq_status = save_and_disable_interrupts();
+    uint32_t irq_status = _flash_lib_lock();
 
     uint32_t physical_sector_address;
     get_physical_sector_from_logical_id(logical_sector, physical_sector_id, &physical_sector_address);
     uint32_t memory_addr = get_memory_addr_from_physical_sector(physical_sector_address);
-    flash_range_erase(memory_addr, FLASH_SECTOR_SIZE);
 
+    // Header must be read before the erase wipes it
     SectorHeader sectorHeader;
     uint8_t headerBuffer[FLASH_PAGE_SIZE];
     read_and_update_header(physical_sector_address, &sectorHeader);
     prepare_buffer_to_write(headerBuffer, &sectorHeader, sizeof(SectorHeader));
-    flash_range_program(memory_addr, headerBuffer, FLASH_PAGE_SIZE);
 
-    restore_interrupts(irq_status);
+    _flash_lib_erase(memory_addr, FLASH_SECTOR_SIZE);
+    _flash_lib_program(memory_addr, headerBuffer, FLASH_PAGE_SIZE);
+
+    _flash_lib_unlock(irq_status);
 }
 
 // void write_sector(uint16_t sector, uint32_t logical_sector_offset, const uint8_t *data, uint32_t count) {
@@ -216,6 +298,7 @@ bool check_sector_signature(uint32_t physical_sector) {
 }
 
 bool get_first_sector_from_logical_id(uint16_t logical_id, uint32_t *physical_addr) {
+    TRACE_BEGIN(TRACE_FLASH_HEADER_SCAN);
     for (uint32_t physical_sector = _lower_bound; physical_sector < _upper_bound; physical_sector += _group_by) {
         if (!check_sector_signature(physical_sector)) {
             continue;
@@ -225,29 +308,32 @@ bool get_first_sector_from_logical_id(uint16_t logical_id, uint32_t *physical_ad
             if (physical_addr != NULL) {
                 *physical_addr = physical_sector;
             }
+            TRACE_END(TRACE_FLASH_HEADER_SCAN);
             return true;
         }
     }
 
+    TRACE_END(TRACE_FLASH_HEADER_SCAN);
     return false;
 }
 
 bool get_physical_sector_from_logical_id(uint16_t logical_id, uint8_t physical_sector_id, uint32_t *physical_addr) {
-    uint32_t physical_sector;
-    bool found = get_first_sector_from_logical_id(logical_id, &physical_sector);
+    uint32_t first_physical_sector;
+    if (!get_first_sector_from_logical_id(logical_id, &first_physical_sector)) {
+        return false;
+    }
 
+    // The physical sectors of a logical sector are consecutive, never look past the group
     for (uint8_t i = 0; i < _group_by; ++i) {
-        if (get_header_attribute_from_sector(physical_sector, PHYSICAL_ID_POSITION) == physical_sector_id) {
-            break;
+        if (get_header_attribute_from_sector(first_physical_sector + i, PHYSICAL_ID_POSITION) == physical_sector_id) {
+            if (physical_addr != NULL) {
+                *physical_addr = first_physical_sector + i;
+            }
+            return true;
         }
-
-        physical_sector += FLASH_SECTOR_SIZE;
     }
 
-    if (physical_addr != NULL) {
-        *physical_addr = physical_sector;
-    }
-    return found;
+    return false;
 }
 
 void prepare_buffer_to_write(uint8_t *buffer, const void *data, uint8_t data_size) {
@@ -263,20 +349,23 @@ void prepare_buffer_to_write(uint8_t *buffer, const void *data, uint8_t data_siz
  * until it finds an uninitialized sector. If no uninitialized sector is found going upwards,
  * it then searches downwards.
  * 
+ * Addresses are aligned on _group_by, the lookups only check the first sector of every group.
+ * 
  * @return An uninitialized sector address within the range defined by _lower_bound and _upper_bound.
  */
 uint16_t _get_random_physical_sector() {
-    uint16_t random_physical_sector = (rand() % (_upper_bound - _lower_bound)) + _lower_bound;
+    uint16_t random_physical_sector = (rand() % _logical_sectors_count) * _group_by + _lower_bound;
 
     // Check upwards
-    for (uint16_t physical_sector = random_physical_sector; physical_sector < _upper_bound; ++physical_sector) {
+    for (uint16_t physical_sector = random_physical_sector; physical_sector < _upper_bound; physical_sector += _group_by) {
         if (!check_sector_signature(physical_sector)) {
             return physical_sector;
         }
     }
 
     // Check downwards
-    for (uint16_t physical_sector = random_physical_sector-1; physical_sector >= _lower_bound; --physical_sector) {
+    for (uint16_t physical_sector = random_physical_sector; physical_sector > _lower_bound;) {
+        physical_sector -= _group_by;
         if (!check_sector_signature(physical_sector)) {
             return physical_sector;
         }
@@ -296,12 +385,12 @@ uint8_t * get_sector_read_pointer(uint32_t physical_sector) {
 void _write_sector_by_physical_addr(uint32_t physical_sector_address, const uint8_t *data) {
     physical_sector_address = get_memory_addr_from_physical_sector(physical_sector_address);
 
-    uint32_t irq_status = save_and_disable_interrupts();
+    uint32_t irq_status = _flash_lib_lock();
 
-    flash_range_erase(physical_sector_address, FLASH_SECTOR_SIZE);
-    flash_range_program(physical_sector_address, data, FLASH_PAGE_SIZE);
+    _flash_lib_erase(physical_sector_address, FLASH_SECTOR_SIZE);
+    _flash_lib_program(physical_sector_address, data, FLASH_PAGE_SIZE);
 
-    restore_interrupts(irq_status);
+    _flash_lib_unlock(irq_status);
 }
 
 void read_and_update_header(uint32_t physical_sector_id, SectorHeader *sectorHeader) {
@@ -331,13 +420,13 @@ void delete_sectors(uint32_t begin, uint32_t end) {
 
     uint8_t *read = get_sector_read_pointer(_lower_bound);
 
-    uint32_t irq_status = save_and_disable_interrupts();
+    uint32_t irq_status = _flash_lib_lock();
     
     for (uint32_t physical_sector = begin; physical_sector < end; ++physical_sector) {
-        flash_range_program(get_memory_addr_from_physical_sector(physical_sector), cleanHeaderBuffer, FLASH_PAGE_SIZE);
+        _flash_lib_program(get_memory_addr_from_physical_sector(physical_sector), cleanHeaderBuffer, FLASH_PAGE_SIZE);
     }
 
-    restore_interrupts(irq_status);
+    _flash_lib_unlock(irq_status);
 }
 
 void delete_all_sectors() {
@@ -428,4 +517,6 @@ void flash_lib_example() {
     end_time = get_absolute_time();
     elapsed_time = 1.0*absolute_time_diff_us(start_time, end_time);
     printf("Time to read all headers: %.2fus\n", elapsed_time);
+
+    trace_print();
 }
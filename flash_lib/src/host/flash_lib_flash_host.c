@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "flash_lib_flash.h"
+
+// Stand-in for the flash chip when building with PICO_PLATFORM=host.
+// - the flash is a PICO_FLASH_SIZE_BYTES array, erased (0xFF) on first use
+// - erase sets bytes to 0xFF, program can only clear bits like the real chip
+// - erases use 64KB blocks where aligned and 4KB sectors elsewhere, like the boot ROM
+// - every operation busy waits the typical time of the chip so latencies match the board
+
+uint8_t *_flashHostImage = NULL;
+uint32_t _flashHostSectorEraseUs = 45000;
+uint32_t _flashHostBlockEraseUs = 150000;
+uint32_t _flashHostPageProgramUs = 400;
+
+uint8_t *flash_lib_host_image() {
+    if (_flashHostImage == NULL) {
+        _flashHostImage = malloc(PICO_FLASH_SIZE_BYTES);
+        memset(_flashHostImage, 0xFF, PICO_FLASH_SIZE_BYTES);
+    }
+    return _flashHostImage;
+}
+
+void flash_lib_host_set_timing(uint32_t sectorEraseUs, uint32_t blockEraseUs, uint32_t pageProgramUs) {
+    _flashHostSectorEraseUs = sectorEraseUs;
+    _flashHostBlockEraseUs = blockEraseUs;
+    _flashHostPageProgramUs = pageProgramUs;
+}
+
+void _flash_host_busy(uint64_t us) {
+    uint64_t start = time_us_64();
+    while (time_us_64() - start < us) {
+        tight_loop_contents();
+    }
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+    assert(flash_offs % FLASH_SECTOR_SIZE == 0);
+    assert(count % FLASH_SECTOR_SIZE == 0);
+    assert(flash_offs + count <= PICO_FLASH_SIZE_BYTES);
+
+    memset(flash_lib_host_image() + flash_offs, 0xFF, count);
+
+    uint64_t busyUs = 0;
+    while (count > 0) {
+        if (flash_offs % FLASH_BLOCK_SIZE == 0 && count >= FLASH_BLOCK_SIZE) {
+            busyUs += _flashHostBlockEraseUs;
+            flash_offs += FLASH_BLOCK_SIZE;
+            count -= FLASH_BLOCK_SIZE;
+        } else {
+            busyUs += _flashHostSectorEraseUs;
+            flash_offs += FLASH_SECTOR_SIZE;
+            count -= FLASH_SECTOR_SIZE;
+        }
+    }
+    _flash_host_busy(busyUs);
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+    assert(flash_offs % FLASH_PAGE_SIZE == 0);
+    assert(count % FLASH_PAGE_SIZE == 0);
+    assert(flash_offs + count <= PICO_FLASH_SIZE_BYTES);
+
+    uint8_t *flash = flash_lib_host_image() + flash_offs;
+    for (size_t i = 0; i < count; i++) {
+        flash[i] &= data[i];
+    }
+    _flash_host_busy((uint64_t) count / FLASH_PAGE_SIZE * _flashHostPageProgramUs);
+}
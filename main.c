@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include "pico/stdlib.h"
 #include "flash_lib.h"
+#include "trace.h"
 
 int main() {
     stdio_init_all();
+    init_trace();
 
     sleep_ms(2000);
     printf("Starting program...\n");
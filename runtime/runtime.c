@@ -0,0 +1,441 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+#include "hardware/structs/sio.h"
+#include "flash_lib.h"
+#include "sensor_log.h"
+#include "744051.h"
+#include "AHT21.h"
+#include "runtime.h"
+#include "trace.h"
+
+Runtime *_runtime;
+
+// memcpy may live in flash, queues are used by core1 while flash is busy
+void __time_critical_func(_runtime_copy)(uint8_t *dst, const uint8_t *src, uint16_t size) {
+    for (uint16_t i = 0; i < size; i++) {
+        dst[i] = src[i];
+    }
+}
+
+/**
+ * @brief Wakes a task, it runs on the next loop pass of its core even if its period didn't elapse.
+ *
+ * Across cores the task index goes through the SIO FIFO, if the FIFO is full the doorbell is lost
+ * and the task runs at its period.
+ *
+ * @param task Task to wake.
+ */
+void __time_critical_func(runtime_ring)(RuntimeTask *task) {
+    if (task->core == get_core_num()) {
+        task->doorbell = true;
+    } else if (multicore_fifo_wready()) {
+        sio_hw->fifo_wr = task->index;
+        __sev();
+    }
+}
+
+/**
+ * @brief One loop pass, runs every task that is due.
+ *
+ * @param runtime Runtime struct.
+ * @param core Core the pass runs on.
+ * @param ramOnly Only runs tasks with RUNTIME_TASK_IN_RAM, used while flash is busy.
+ */
+void __time_critical_func(_runtime_run_tasks)(Runtime *runtime, RuntimeCore *core, bool ramOnly) {
+    // Doorbells from the other core
+    while (multicore_fifo_rvalid()) {
+        uint32_t index = sio_hw->fifo_rd;
+        if (index < core->taskCount) {
+            core->tasks[index].doorbell = true;
+        }
+    }
+
+    for (uint8_t i = 0; i < core->taskCount; i++) {
+        RuntimeTask *task = &core->tasks[i];
+        if (ramOnly && !(task->flags & RUNTIME_TASK_IN_RAM)) {
+            continue;
+        }
+
+        uint32_t start = time_us_32();
+        bool due = task->periodUs != RUNTIME_NO_PERIOD && (int32_t) (start - task->nextRun) >= 0;
+        if (!due && !task->doorbell) {
+            continue;
+        }
+
+        if (due) {
+            task->nextRun += task->periodUs;
+            if ((int32_t) (start - task->nextRun) >= 0) {
+                // Fell behind, drop the missed periods
+                task->nextRun = start + task->periodUs;
+            }
+        }
+        task->doorbell = false;
+
+        task->function(task->userData);
+
+        uint32_t elapsed = time_us_32() - start;
+        task->runCount++;
+        task->busyTime += elapsed;
+        if (elapsed > task->maxTime) {
+            task->maxTime = elapsed;
+        }
+        core->busyTime += elapsed;
+    }
+
+    core->loopCount++;
+}
+
+void __time_critical_func(_runtime_core1_loop)() {
+    Runtime *runtime = _runtime;
+    RuntimeCore *core = &runtime->cores[1];
+
+    runtime->core1Running = true;
+    while (true) {
+        if (runtime->flashBusy) {
+            // Core0 is about to touch flash, only tasks in SRAM run until it is done
+            uint32_t irqStatus = save_and_disable_interrupts();
+            runtime->flashAck = true;
+            while (runtime->flashBusy) {
+                _runtime_run_tasks(runtime, core, true);
+            }
+            runtime->flashAck = false;
+            restore_interrupts(irqStatus);
+        }
+
+        _runtime_run_tasks(runtime, core, false);
+    }
+}
+
+// flash_lib hook, waits until core1 stopped running code from flash
+void __time_critical_func(_runtime_flash_begin)() {
+    Runtime *runtime = _runtime;
+    if (!runtime->core1Running || get_core_num() != 0) {
+        return;
+    }
+
+    uint32_t start = time_us_32();
+    runtime->flashBusy = true;
+    while (!runtime->flashAck) {
+        tight_loop_contents();
+    }
+    runtime->flashWaitTime += time_us_32() - start;
+    runtime->flashOperations++;
+}
+
+// flash_lib hook, lets core1 run from flash again
+void __time_critical_func(_runtime_flash_end)() {
+    Runtime *runtime = _runtime;
+    if (!runtime->core1Running || get_core_num() != 0) {
+        return;
+    }
+
+    runtime->flashBusy = false;
+
+    // Core1 must be out of the handshake before the next flash operation can start
+    while (runtime->flashAck) {
+        tight_loop_contents();
+    }
+}
+
+/**
+ * @brief Initializes the runtime, only one runtime can exist.
+ *
+ * Also hooks into flash_lib so flash operations from core0 are coordinated with core1.
+ *
+ * @param runtime Runtime struct, must stay valid forever.
+ */
+void init_runtime(Runtime *runtime) {
+    for (uint8_t i = 0; i < 2; i++) {
+        runtime->cores[i].taskCount = 0;
+        runtime->cores[i].busyTime = 0;
+        runtime->cores[i].loopCount = 0;
+        runtime->cores[i].lastBusyTime = 0;
+    }
+    runtime->core1Running = false;
+    runtime->flashBusy = false;
+    runtime->flashAck = false;
+    runtime->flashOperations = 0;
+    runtime->flashWaitTime = 0;
+    runtime->lastStatsTime = time_us_32();
+
+    _runtime = runtime;
+    set_flash_lib_hooks(_runtime_flash_begin, _runtime_flash_end);
+}
+
+/**
+ * @brief Adds a task to one of the cores, must be called before runtime_start.
+ *
+ * @param runtime Runtime struct.
+ * @param core 0 for storage/communication, 1 for acquisition.
+ * @param function Task function, must return quickly.
+ * @param userData Passed to function.
+ * @param periodUs Time between runs, 0 runs on every loop pass, RUNTIME_NO_PERIOD only runs on doorbells.
+ * @param flags RUNTIME_TASK_IN_RAM if function and everything it calls is in SRAM.
+ * @return The task, used as queue consumer and for runtime_ring.
+ */
+RuntimeTask *runtime_add_task(Runtime *runtime, uint8_t core, RuntimeTaskFunction function, void *userData, uint32_t periodUs, uint8_t flags) {
+    assert(core < 2);
+    RuntimeCore *runtimeCore = &runtime->cores[core];
+    assert(runtimeCore->taskCount < RUNTIME_MAX_TASKS);
+
+    RuntimeTask *task = &runtimeCore->tasks[runtimeCore->taskCount];
+    task->function = function;
+    task->userData = userData;
+    task->periodUs = periodUs;
+    task->nextRun = time_us_32();
+    task->flags = flags;
+    task->core = core;
+    task->index = runtimeCore->taskCount;
+    task->doorbell = false;
+    task->runCount = 0;
+    task->busyTime = 0;
+    task->maxTime = 0;
+
+    runtimeCore->taskCount++;
+    return task;
+}
+
+/**
+ * @brief Launches core1 and runs the core0 loop, never returns.
+ *
+ * @param runtime Runtime struct.
+ */
+void runtime_start(Runtime *runtime) {
+    multicore_fifo_drain();
+    multicore_launch_core1(_runtime_core1_loop);
+
+    RuntimeCore *core = &runtime->cores[0];
+    while (true) {
+        _runtime_run_tasks(runtime, core, false);
+    }
+}
+
+/**
+ * @brief Initializes a single producer, single consumer queue.
+ *
+ * @param queue RuntimeQueue struct.
+ * @param itemSize Size of one item in bytes.
+ * @param capacity Number of items, must be a power of 2.
+ * @param consumer Task that pops the queue, rung when an item arrives in an empty queue. Can be NULL.
+ *
+ * @return false if capacity is not a power of 2 or the buffer can't be allocated.
+ */
+bool init_runtime_queue(RuntimeQueue *queue, uint16_t itemSize, uint16_t capacity, RuntimeTask *consumer) {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        return false;
+    }
+
+    queue->buffer = (uint8_t *) malloc(itemSize * capacity);
+    if (queue->buffer == NULL) {
+        return false;
+    }
+    queue->itemSize = itemSize;
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->consumer = consumer;
+    queue->droppedItems = 0;
+    return true;
+}
+
+// Producer side, false if the queue is full and the item was dropped
+bool __time_critical_func(runtime_queue_push)(RuntimeQueue *queue, const void *item) {
+    uint32_t head = queue->head;
+    uint32_t tail = queue->tail;
+    if (head - tail == queue->capacity) {
+        queue->droppedItems++;
+        return false;
+    }
+
+    _runtime_copy(&queue->buffer[(head & (queue->capacity - 1)) * queue->itemSize], (const uint8_t *) item, queue->itemSize);
+
+    // Item must be written before it is published
+    __dmb();
+    queue->head = head + 1;
+
+    if (head == tail && queue->consumer != NULL) {
+        runtime_ring(queue->consumer);
+    }
+    return true;
+}
+
+// Consumer side, false if the queue is empty
+bool __time_critical_func(runtime_queue_pop)(RuntimeQueue *queue, void *item) {
+    uint32_t tail = queue->tail;
+    if (queue->head == tail) {
+        return false;
+    }
+
+    // Item must not be read before head was seen
+    __dmb();
+    _runtime_copy((uint8_t *) item, &queue->buffer[(tail & (queue->capacity - 1)) * queue->itemSize], queue->itemSize);
+
+    // Item must be read before the slot is handed back
+    __dmb();
+    queue->tail = tail + 1;
+    return true;
+}
+
+uint32_t __time_critical_func(runtime_queue_count)(RuntimeQueue *queue) {
+    return queue->head - queue->tail;
+}
+
+/**
+ * @brief Returns the fraction of time each core spent in tasks since the last call.
+ *
+ * @param runtime Runtime struct.
+ * @param core0Load Load of core0, 0 to 1.
+ * @param core1Load Load of core1, 0 to 1.
+ */
+void get_runtime_stats(Runtime *runtime, float *core0Load, float *core1Load) {
+    uint32_t now = time_us_32();
+    uint32_t elapsed = now - runtime->lastStatsTime;
+    float *loads[2] = {core0Load, core1Load};
+
+    for (uint8_t i = 0; i < 2; i++) {
+        RuntimeCore *core = &runtime->cores[i];
+        uint32_t busyTime = core->busyTime;
+        *loads[i] = (float) (busyTime - core->lastBusyTime) / elapsed;
+        core->lastBusyTime = busyTime;
+    }
+
+    runtime->lastStatsTime = now;
+}
+
+typedef struct RuntimeExampleSample {
+    uint32_t timestamp;
+    int32_t values[10];
+} RuntimeExampleSample;
+
+typedef struct RuntimeExample {
+    Runtime runtime;
+    RuntimeQueue samples;
+    SensorLog log;
+    C744051 c744051;
+    AHT21 aht21;
+    AHT21 *sensors[1];
+    AHT21Fleet fleet;
+    volatile int32_t humidity;
+    volatile int32_t temperature;
+    uint64_t lastTimestamp;
+} RuntimeExample;
+
+void _runtime_example_aht21_callback(AHT21 *aht21, void *userData) {
+    RuntimeExample *example = (RuntimeExample *) userData;
+    if (aht21->measurement.status == AHT21_OK) {
+        example->humidity = aht21->measurement.humidityCenti;
+        example->temperature = aht21->measurement.temperatureCenti;
+    }
+}
+
+// Core1, keeps sampling while core0 writes flash
+void __time_critical_func(_runtime_example_scan)(void *userData) {
+    RuntimeExample *example = (RuntimeExample *) userData;
+    RuntimeExampleSample sample;
+    uint16_t adc[8];
+
+    read_744051_masked(example->c744051, 0xFF, 1, adc, false);
+    sample.timestamp = time_us_32();
+    for (uint8_t i = 0; i < 8; i++) {
+        sample.values[i] = adc[i];
+    }
+    sample.values[8] = example->humidity;
+    sample.values[9] = example->temperature;
+
+    runtime_queue_push(&example->samples, &sample);
+}
+
+// Core1, paused while flash is busy
+void _runtime_example_aht21(void *userData) {
+    RuntimeExample *example = (RuntimeExample *) userData;
+    AHT21_pollFleet(&example->fleet);
+}
+
+// Core0, moves samples from core1 into the log staging ring
+void _runtime_example_store(void *userData) {
+    RuntimeExample *example = (RuntimeExample *) userData;
+    RuntimeExampleSample sample;
+
+    while (runtime_queue_pop(&example->samples, &sample)) {
+        // Extends the 32 bit timestamps taken on core1
+        example->lastTimestamp += (uint32_t) (sample.timestamp - (uint32_t) example->lastTimestamp);
+        sensor_log_append(&example->log, example->lastTimestamp, sample.values);
+    }
+}
+
+// Core0, erases ahead and writes full blocks
+void _runtime_example_flash(void *userData) {
+    RuntimeExample *example = (RuntimeExample *) userData;
+    sensor_log_task(&example->log);
+}
+
+void _runtime_example_report(void *userData) {
+    RuntimeExample *example = (RuntimeExample *) userData;
+
+    float core0Load;
+    float core1Load;
+    get_runtime_stats(&example->runtime, &core0Load, &core1Load);
+
+    float bytesPerSample;
+    float samplesPerSecond;
+    get_sensor_log_stats(&example->log, &bytesPerSample, &samplesPerSecond);
+
+    printf("Core0 %.1f%%, core1 %.1f%%, %.1f samples/s, %.2f bytes/sample, %u dropped, %u flash ops waited %uus\n",
+           core0Load * 100, core1Load * 100, samplesPerSecond, bytesPerSample, example->samples.droppedItems,
+           example->runtime.flashOperations, example->runtime.flashWaitTime);
+
+    // Binary, decoded with trace/tools/trace_decode.py, nothing is sent unless tracing is on
+    trace_dump();
+}
+
+void runtime_example() {
+    RuntimeExample *example = (RuntimeExample *) calloc(1, sizeof(RuntimeExample));
+    if (example == NULL) {
+        printf("Not enough memory for the example\n");
+        return;
+    }
+
+    init_flash_lib(100, 4, GROUP_BY_8);
+    if (!init_sensor_log(&example->log, 0, 4, 10, 512)) {
+        printf("Not enough memory for the sensor log\n");
+        return;
+    }
+    example->lastTimestamp = time_us_64();
+
+    init_744051_adc();
+    init_744051(&example->c744051, 26, NO_DISABLE_PIN, 10, 11, 12);
+
+    i2c_init(i2c0, 400000);
+    gpio_set_function(4, GPIO_FUNC_I2C);
+    gpio_set_function(5, GPIO_FUNC_I2C);
+    gpio_pull_up(4);
+    gpio_pull_up(5);
+    sleep_ms(100);
+    AHT21_init(&example->aht21, i2c0, AHT21_ADDRESS, AHT21_NO_SWITCH, 0);
+    example->sensors[0] = &example->aht21;
+    if (!AHT21_startFleetPolled(&example->fleet, example->sensors, 1, 1000000, _runtime_example_aht21_callback, example)) {
+        printf("Not enough memory for the AHT21 fleet\n");
+        return;
+    }
+
+    Runtime *runtime = &example->runtime;
+    init_runtime(runtime);
+
+    // Acquisition
+    runtime_add_task(runtime, 1, _runtime_example_scan, example, 1000, RUNTIME_TASK_IN_RAM);
+    runtime_add_task(runtime, 1, _runtime_example_aht21, example, AHT21_I2C_WAIT_US, 0);
+
+    // Storage, the store task is woken by the queue and runs every 20ms in case a doorbell was lost
+    RuntimeTask *store = runtime_add_task(runtime, 0, _runtime_example_store, example, 20000, 0);
+    runtime_add_task(runtime, 0, _runtime_example_flash, example, 1000, 0);
+    runtime_add_task(runtime, 0, _runtime_example_report, example, 5000000, 0);
+    if (!init_runtime_queue(&example->samples, sizeof(RuntimeExampleSample), 256, store)) {
+        printf("Not enough memory for the sample queue\n");
+        return;
+    }
+
+    runtime_start(runtime);
+}
@@ -0,0 +1,100 @@
+/**
+ * @brief Small cooperative runtime that splits the work between both cores.
+ *
+ * *** Cores ***
+ * - Core1 runs acquisition tasks (744051 scans, shift register I/O, AHT21 polling), core0 runs
+ *   storage and communication tasks.
+ * - Each core loops over its own task list, a task runs when its period elapsed or when its doorbell
+ *   was rung. Tasks must return quickly, nothing is preempted.
+ * - Time spent in tasks is counted per task and per core, get_runtime_stats turns it into load.
+ *
+ * *** Queues ***
+ * - RuntimeQueue is a lock-free single producer, single consumer ring, one core pushes and the
+ *   other pops without locks or disabling interrupts.
+ * - When a push makes the queue non-empty the consumer task is rung, across cores the doorbell
+ *   goes through the SIO hardware FIFO so the consumer runs on its next loop pass.
+ *
+ * *** Flash ***
+ * - Flash can only be erased/programmed from core0, flash_lib calls the runtime before and after.
+ * - While flash is busy core1 keeps looping but only runs tasks added with RUNTIME_TASK_IN_RAM,
+ *   those tasks and everything they call must be in SRAM (__time_critical_func), including any
+ *   const data they read. Core1 interrupts are held off until flash is done.
+ * - Core1 must not use flash_lib or anything else that writes flash.
+ */
+
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include "pico/stdlib.h"
+
+#define RUNTIME_MAX_TASKS 16
+
+// Task flags
+#define RUNTIME_TASK_IN_RAM 0x01  // Task keeps running on core1 while flash is busy
+
+// Period of tasks that only run when their doorbell is rung
+#define RUNTIME_NO_PERIOD 0xFFFFFFFF
+
+typedef void (*RuntimeTaskFunction)(void *userData);
+
+typedef struct RuntimeTask {
+    RuntimeTaskFunction function;
+    void *userData;
+    uint32_t periodUs;  // 0 runs on every loop pass
+    uint32_t nextRun;
+    uint8_t flags;
+    uint8_t core;
+    uint8_t index;
+    volatile bool doorbell;
+
+    // Statistics
+    uint32_t runCount;
+    uint32_t busyTime;
+    uint32_t maxTime;
+} RuntimeTask;
+
+typedef struct RuntimeCore {
+    RuntimeTask tasks[RUNTIME_MAX_TASKS];
+    uint8_t taskCount;
+
+    // Statistics
+    volatile uint32_t busyTime;
+    volatile uint32_t loopCount;
+    uint32_t lastBusyTime;
+} RuntimeCore;
+
+typedef struct Runtime {
+    RuntimeCore cores[2];
+    volatile bool core1Running;
+
+    // Flash handshake, core0 sets flashBusy and waits for core1 to acknowledge
+    volatile bool flashBusy;
+    volatile bool flashAck;
+    uint32_t flashOperations;
+    uint32_t flashWaitTime;  // Time core0 waited for core1 to stop running from flash
+
+    uint32_t lastStatsTime;
+} Runtime;
+
+typedef struct RuntimeQueue {
+    uint8_t *buffer;
+    uint16_t itemSize;
+    uint16_t capacity;  // Power of 2
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    RuntimeTask *consumer;  // Rung when the queue stops being empty, can be NULL
+    volatile uint32_t droppedItems;
+} RuntimeQueue;
+
+void init_runtime(Runtime *runtime);
+RuntimeTask *runtime_add_task(Runtime *runtime, uint8_t core, RuntimeTaskFunction function, void *userData, uint32_t periodUs, uint8_t flags);
+void runtime_ring(RuntimeTask *task);
+void runtime_start(Runtime *runtime);
+bool init_runtime_queue(RuntimeQueue *queue, uint16_t itemSize, uint16_t capacity, RuntimeTask *consumer);
+bool runtime_queue_push(RuntimeQueue *queue, const void *item);
+bool runtime_queue_pop(RuntimeQueue *queue, void *item);
+uint32_t runtime_queue_count(RuntimeQueue *queue);
+void get_runtime_stats(Runtime *runtime, float *core0Load, float *core1Load);
+void runtime_example();
+
+#endif
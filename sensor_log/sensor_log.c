@@ -0,0 +1,573 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "hardware/sync.h"
+#include "flash_lib.h"
+#include "744051.h"
+#include "AHT21.h"
+#include "sensor_log.h"
+#include "trace.h"
+
+uint8_t _sensor_log_varint_size(uint64_t value) {
+    uint8_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+uint8_t *_sensor_log_put_varint(uint8_t *dst, uint64_t value) {
+    while (value >= 0x80) {
+        *dst++ = value | 0x80;
+        value >>= 7;
+    }
+    *dst++ = value;
+    return dst;
+}
+
+const uint8_t *_sensor_log_get_varint(const uint8_t *src, const uint8_t *end, uint64_t *value) {
+    uint64_t result = 0;
+    uint8_t shift = 0;
+    while (src < end && shift < 64) {
+        uint8_t byte = *src++;
+        result |= (uint64_t) (byte & 0x7F) << shift;
+        shift += 7;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    *value = result;
+    return src;
+}
+
+// Maps small negative and positive differences to small unsigned values, -1 -> 1, 1 -> 2
+uint32_t _sensor_log_zigzag(uint32_t delta) {
+    return (delta << 1) ^ (uint32_t) ((int32_t) delta >> 31);
+}
+
+uint32_t _sensor_log_unzigzag(uint32_t value) {
+    return (value >> 1) ^ -(value & 1);
+}
+
+uint16_t _sensor_log_fletcher16(const uint8_t *data, uint16_t length) {
+    uint16_t sum1 = 0;
+    uint16_t sum2 = 0;
+    for (uint16_t i = 0; i < length; i++) {
+        sum1 = (sum1 + data[i]) % 255;
+        sum2 = (sum2 + sum1) % 255;
+    }
+    return (sum2 << 8) | sum1;
+}
+
+uint64_t _sensor_log_staged_timestamp(SensorLog *log, uint32_t index) {
+    return log->timestamps[index % log->stagingCapacity];
+}
+
+int32_t *_sensor_log_staged_values(SensorLog *log, uint32_t index) {
+    return &log->values[(index % log->stagingCapacity) * log->channelCount];
+}
+
+uint8_t *_sensor_log_page(SensorLog *log, uint16_t segment, uint32_t page) {
+    uint8_t *sector = log->sectorPointers[segment * log->groupBy + page / SENSOR_LOG_PAGES_PER_SECTOR];
+    return sector + (page % SENSOR_LOG_PAGES_PER_SECTOR + 1) * FLASH_PAGE_SIZE;
+}
+
+bool _sensor_log_read_header(SensorLog *log, const uint8_t *block, SensorLogBlockHeader *header) {
+    memcpy(header, block, sizeof(SensorLogBlockHeader));
+
+    if (header->magic != SENSOR_LOG_MAGIC || header->channelCount != log->channelCount) {
+        return false;
+    }
+    if (header->sampleCount == 0 || header->payloadLength > SENSOR_LOG_PAYLOAD_SIZE) {
+        return false;
+    }
+
+    // Catches pages left half programmed by a power loss
+    return _sensor_log_fletcher16(block + sizeof(SensorLogBlockHeader), header->payloadLength) == header->checksum;
+}
+
+/**
+ * @brief Counts how many staged samples fit in one block.
+ *
+ * @param[in] log SensorLog struct.
+ * @param[in] tail Index of the first staged sample.
+ * @param[in] available Number of staged samples.
+ * @param[out] payloadLength Encoded size of the samples that fit.
+ * @param[out] full True if the block can't take another sample.
+ * @return Number of samples that fit.
+ */
+uint16_t _sensor_log_fit_samples(SensorLog *log, uint32_t tail, uint32_t available, uint16_t *payloadLength, bool *full) {
+    uint32_t bytes = 0;
+    uint16_t count = 0;
+    *full = false;
+
+    while (count < available) {
+        if (count == UINT8_MAX) {
+            *full = true;
+            break;
+        }
+
+        uint32_t index = tail + count;
+        int32_t *sample = _sensor_log_staged_values(log, index);
+        int32_t *previous = count > 0 ? _sensor_log_staged_values(log, index - 1) : NULL;
+
+        // The first timestamp of a block lives in the header
+        uint32_t cost = 0;
+        if (count > 0) {
+            cost += _sensor_log_varint_size(_sensor_log_staged_timestamp(log, index) - _sensor_log_staged_timestamp(log, index - 1));
+        }
+        for (uint8_t c = 0; c < log->channelCount; c++) {
+            uint32_t delta = (uint32_t) sample[c] - (previous != NULL ? (uint32_t) previous[c] : 0);
+            cost += _sensor_log_varint_size(_sensor_log_zigzag(delta));
+        }
+
+        if (bytes + cost > SENSOR_LOG_PAYLOAD_SIZE) {
+            *full = true;
+            break;
+        }
+        bytes += cost;
+        count++;
+    }
+
+    *payloadLength = bytes;
+    return count;
+}
+
+void _sensor_log_encode_block(SensorLog *log, uint32_t tail, uint16_t count, uint16_t payloadLength, uint8_t *page) {
+    memset(page, 0xFF, FLASH_PAGE_SIZE);
+    uint8_t *payload = page + sizeof(SensorLogBlockHeader);
+    uint8_t *dst = payload;
+
+    for (uint16_t i = 1; i < count; i++) {
+        dst = _sensor_log_put_varint(dst, _sensor_log_staged_timestamp(log, tail + i) - _sensor_log_staged_timestamp(log, tail + i - 1));
+    }
+
+    for (uint8_t c = 0; c < log->channelCount; c++) {
+        uint32_t previous = 0;
+        for (uint16_t i = 0; i < count; i++) {
+            uint32_t value = _sensor_log_staged_values(log, tail + i)[c];
+            dst = _sensor_log_put_varint(dst, _sensor_log_zigzag(value - previous));
+            previous = value;
+        }
+    }
+    assert(dst - payload == payloadLength);
+
+    uint64_t firstTimestamp = _sensor_log_staged_timestamp(log, tail);
+    SensorLogBlockHeader header = {
+        .magic = SENSOR_LOG_MAGIC,
+        .sampleCount = count,
+        .channelCount = log->channelCount,
+        .sequence = log->sequence,
+        .firstTimestamp = firstTimestamp,
+        .span = _sensor_log_staged_timestamp(log, tail + count - 1) - firstTimestamp,
+        .payloadLength = payloadLength,
+        .checksum = _sensor_log_fletcher16(payload, payloadLength),
+    };
+    memcpy(page, &header, sizeof(SensorLogBlockHeader));
+}
+
+// Erases one physical sector of the given segment, the segment is ready once all of them are erased
+void _sensor_log_erase_step(SensorLog *log, uint16_t segment) {
+    if (log->eraseSegment != segment) {
+        log->eraseSegment = segment;
+        log->erasedSectors = 0;
+    }
+
+    uint32_t start = time_us_32();
+    erase_physical_sector(log->firstSector + segment, log->erasedSectors);
+    uint32_t eraseTime = time_us_32() - start;
+    if (eraseTime > log->maxEraseTime) {
+        log->maxEraseTime = eraseTime;
+    }
+
+    log->erasedSectors++;
+    log->sectorErases++;
+    if (segment == log->segment && log->erasedSectors == log->groupBy) {
+        log->segmentReady = true;
+    }
+}
+
+void _sensor_log_write_block(SensorLog *log, uint8_t *page) {
+    uint32_t offset = (log->page / SENSOR_LOG_PAGES_PER_SECTOR) * FLASH_SECTOR_SIZE + (log->page % SENSOR_LOG_PAGES_PER_SECTOR + 1) * FLASH_PAGE_SIZE;
+    write_sector_page(log->firstSector + log->segment, offset, page);
+
+    log->sequence++;
+    log->pagesWritten++;
+    log->page++;
+    if (log->page < log->pagesPerSegment) {
+        return;
+    }
+
+    // Moves to the next segment, normally erased ahead by sensor_log_task
+    log->page = 0;
+    log->segment = (log->segment + 1) % log->sectorCount;
+    log->segmentReady = log->eraseSegment == log->segment && log->erasedSectors == log->groupBy;
+}
+
+/**
+ * @brief Initializes a log over flash_lib logical sectors, init_flash_lib must be called before.
+ *
+ * @param log SensorLog struct.
+ * @param firstSector First flash_lib logical sector used by the log.
+ * @param sectorCount Number of logical sectors used, at least 2.
+ * @param channelCount Values per sample, up to SENSOR_LOG_MAX_CHANNELS.
+ * @param stagingCapacity Samples the SRAM staging ring can hold, it must absorb the samples taken during one sector erase.
+ *
+ * @return false if sectorCount or channelCount is out of range or the buffers can't be allocated.
+ */
+bool init_sensor_log(SensorLog *log, uint16_t firstSector, uint16_t sectorCount, uint8_t channelCount, uint16_t stagingCapacity) {
+    if (sectorCount < 2 || channelCount == 0 || channelCount > SENSOR_LOG_MAX_CHANNELS) {
+        return false;
+    }
+
+    log->firstSector = firstSector;
+    log->sectorCount = sectorCount;
+    log->groupBy = get_logical_sector_size() / FLASH_SECTOR_SIZE;
+    log->channelCount = channelCount;
+    log->pagesPerSegment = log->groupBy * SENSOR_LOG_PAGES_PER_SECTOR;
+
+    log->sectorPointers = (uint8_t **) malloc(sectorCount * log->groupBy * sizeof(uint8_t *));
+    log->timestamps = (uint64_t *) calloc(stagingCapacity, sizeof(uint64_t));
+    log->values = (int32_t *) calloc(stagingCapacity * channelCount, sizeof(int32_t));
+    if (log->sectorPointers == NULL || log->timestamps == NULL || log->values == NULL) {
+        free(log->sectorPointers);
+        free(log->timestamps);
+        free(log->values);
+        log->sectorPointers = NULL;
+        log->timestamps = NULL;
+        log->values = NULL;
+        return false;
+    }
+
+    for (uint16_t segment = 0; segment < sectorCount; segment++) {
+        for (uint8_t i = 0; i < log->groupBy; i++) {
+            log->sectorPointers[segment * log->groupBy + i] = read_sector(firstSector + segment, i * FLASH_SECTOR_SIZE);
+        }
+    }
+
+    log->stagingCapacity = stagingCapacity;
+    log->stagingHead = 0;
+    log->stagingTail = 0;
+    log->flushRequested = false;
+
+    log->samplesLogged = 0;
+    log->pagesWritten = 0;
+    log->sectorErases = 0;
+    log->droppedSamples = 0;
+    log->maxEraseTime = 0;
+    log->lastStatsTime = time_us_32();
+    log->lastSamplesLogged = 0;
+    log->lastPagesWritten = 0;
+
+    // Resumes after the newest block
+    bool found = false;
+    uint32_t newestSequence = 0;
+    uint16_t newestSegment = 0;
+    uint32_t newestPage = 0;
+    for (uint16_t segment = 0; segment < sectorCount; segment++) {
+        for (uint32_t page = 0; page < log->pagesPerSegment; page++) {
+            SensorLogBlockHeader header;
+            if (!_sensor_log_read_header(log, _sensor_log_page(log, segment, page), &header)) {
+                continue;
+            }
+
+            if (!found || (int32_t) (header.sequence - newestSequence) > 0) {
+                found = true;
+                newestSequence = header.sequence;
+                newestSegment = segment;
+                newestPage = page;
+            }
+        }
+    }
+
+    if (!found) {
+        log->segment = 0;
+        log->page = 0;
+        log->sequence = 0;
+        log->segmentReady = false;
+    } else if (newestPage + 1 == log->pagesPerSegment) {
+        log->segment = (newestSegment + 1) % sectorCount;
+        log->page = 0;
+        log->sequence = newestSequence + 1;
+        log->segmentReady = false;
+    } else {
+        log->segment = newestSegment;
+        log->page = newestPage + 1;
+        log->sequence = newestSequence + 1;
+        log->segmentReady = true;
+    }
+
+    log->eraseSegment = log->segment;
+    log->erasedSectors = log->segmentReady ? log->groupBy : 0;
+    return true;
+}
+
+/**
+ * @brief Adds one sample to the staging ring, doesn't touch flash.
+ *
+ * Must only be called from one context at a time, timestamps must not decrease.
+ *
+ * @param log SensorLog struct.
+ * @param timestamp Sample time, time_us_64() works well.
+ * @param values channelCount values.
+ * @return False if the staging ring is full and the sample was dropped.
+ */
+bool sensor_log_append(SensorLog *log, uint64_t timestamp, const int32_t *values) {
+    uint32_t head = log->stagingHead;
+    if (head - log->stagingTail == log->stagingCapacity) {
+        log->droppedSamples++;
+        return false;
+    }
+
+    log->timestamps[head % log->stagingCapacity] = timestamp;
+    memcpy(_sensor_log_staged_values(log, head), values, log->channelCount * sizeof(int32_t));
+
+    // Sample must be written before it is published
+    __dmb();
+    log->stagingHead = head + 1;
+    return true;
+}
+
+/**
+ * @brief Moves staged samples to flash, call it often from the main loop.
+ *
+ * Does at most one flash operation per call: programs a full block or erases one physical sector.
+ * Partial blocks are only written by sensor_log_flush or when the staging ring is full.
+ *
+ * @return True if a flash operation was done.
+ */
+bool sensor_log_task(SensorLog *log) {
+    if (!log->segmentReady) {
+        _sensor_log_erase_step(log, log->segment);
+        return true;
+    }
+
+    uint32_t tail = log->stagingTail;
+    uint32_t available = log->stagingHead - tail;
+    if (available > 0) {
+        uint16_t payloadLength;
+        bool full;
+        uint16_t count = _sensor_log_fit_samples(log, tail, available, &payloadLength, &full);
+
+        if (full || log->flushRequested || available == log->stagingCapacity) {
+            uint8_t page[FLASH_PAGE_SIZE];
+            TRACE_BEGIN(TRACE_SENSOR_LOG_ENCODE);
+            _sensor_log_encode_block(log, tail, count, payloadLength, page);
+            TRACE_END(TRACE_SENSOR_LOG_ENCODE);
+            _sensor_log_write_block(log, page);
+            log->samplesLogged += count;
+
+            // Samples must be read before the slots are handed back
+            __dmb();
+            log->stagingTail = tail + count;
+            return true;
+        }
+    }
+
+    // Nothing to write, erases the next segment ahead of time
+    uint16_t nextSegment = (log->segment + 1) % log->sectorCount;
+    if (log->eraseSegment != nextSegment || log->erasedSectors < log->groupBy) {
+        _sensor_log_erase_step(log, nextSegment);
+        return true;
+    }
+    return false;
+}
+
+// Writes every sample staged so far to flash, the last block may be partially filled
+void sensor_log_flush(SensorLog *log) {
+    uint32_t target = log->stagingHead;
+
+    log->flushRequested = true;
+    while ((int32_t) (target - log->stagingTail) > 0) {
+        sensor_log_task(log);
+    }
+    log->flushRequested = false;
+}
+
+uint32_t _sensor_log_decode_block(SensorLog *log, const uint8_t *block, SensorLogBlockHeader *header, uint64_t from, uint64_t to, SensorLogCallback callback, void *userData) {
+    const uint8_t *src = block + sizeof(SensorLogBlockHeader);
+    const uint8_t *end = src + header->payloadLength;
+
+    // Columns are stored one after the other, the timestamp column has one entry less
+    const uint8_t *columns[SENSOR_LOG_MAX_CHANNELS + 1];
+    for (uint8_t c = 0; c <= log->channelCount; c++) {
+        columns[c] = src;
+
+        uint16_t entries = c == 0 ? header->sampleCount - 1 : header->sampleCount;
+        while (entries > 0 && src < end) {
+            if (!(*src++ & 0x80)) {
+                entries--;
+            }
+        }
+    }
+
+    uint32_t matches = 0;
+    uint64_t timestamp = header->firstTimestamp;
+    int32_t values[SENSOR_LOG_MAX_CHANNELS] = {0};
+    for (uint16_t i = 0; i < header->sampleCount; i++) {
+        uint64_t value;
+        if (i > 0) {
+            columns[0] = _sensor_log_get_varint(columns[0], end, &value);
+            timestamp += value;
+        }
+        for (uint8_t c = 0; c < log->channelCount; c++) {
+            columns[c + 1] = _sensor_log_get_varint(columns[c + 1], end, &value);
+            values[c] = (uint32_t) values[c] + _sensor_log_unzigzag(value);
+        }
+
+        if (timestamp > to) {
+            break;
+        }
+        if (timestamp >= from) {
+            if (callback != NULL) {
+                callback(timestamp, values, log->channelCount, userData);
+            }
+            matches++;
+        }
+    }
+    return matches;
+}
+
+/**
+ * @brief Calls callback for every logged sample with from <= timestamp <= to, oldest first.
+ *
+ * Blocks are decoded straight from XIP memory, blocks outside the range are skipped by their header.
+ * Samples still in the staging ring are not seen, call sensor_log_flush first if they are needed.
+ *
+ * @param log SensorLog struct.
+ * @param from First timestamp of the range.
+ * @param to Last timestamp of the range.
+ * @param callback Called for every sample, may be NULL to only count them.
+ * @param userData Passed to the callback.
+ * @return Number of samples in the range.
+ */
+uint32_t sensor_log_query(SensorLog *log, uint64_t from, uint64_t to, SensorLogCallback callback, void *userData) {
+    uint32_t totalPages = log->sectorCount * log->pagesPerSegment;
+    uint32_t start = log->segment * log->pagesPerSegment + log->page;
+    uint32_t matches = 0;
+
+    // The oldest blocks are the ones right after the write position
+    for (uint32_t i = 0; i < totalPages; i++) {
+        uint32_t position = (start + i) % totalPages;
+        const uint8_t *block = _sensor_log_page(log, position / log->pagesPerSegment, position % log->pagesPerSegment);
+
+        SensorLogBlockHeader header;
+        if (!_sensor_log_read_header(log, block, &header)) {
+            continue;
+        }
+        if (header.firstTimestamp > to || header.firstTimestamp + header.span < from) {
+            continue;
+        }
+
+        matches += _sensor_log_decode_block(log, block, &header, from, to, callback, userData);
+    }
+    return matches;
+}
+
+/**
+ * @brief Returns the statistics since the last call.
+ *
+ * @param log SensorLog struct.
+ * @param bytesPerSample Flash used per sample, block headers and padding included.
+ * @param samplesPerSecond Samples moved to flash per second.
+ */
+void get_sensor_log_stats(SensorLog *log, float *bytesPerSample, float *samplesPerSecond) {
+    uint32_t now = time_us_32();
+    uint32_t samples = log->samplesLogged - log->lastSamplesLogged;
+    uint32_t pages = log->pagesWritten - log->lastPagesWritten;
+    uint32_t elapsed = now - log->lastStatsTime;
+
+    *bytesPerSample = samples > 0 ? (float) pages * FLASH_PAGE_SIZE / samples : 0;
+    *samplesPerSecond = (float) samples * 1000000 / elapsed;
+
+    log->lastStatsTime = now;
+    log->lastSamplesLogged = log->samplesLogged;
+    log->lastPagesWritten = log->pagesWritten;
+}
+
+// Called from AHT21_pollFleet in the example loop, never while values is being appended
+void _sensor_log_example_aht21_callback(AHT21 *aht21, void *userData) {
+    int32_t *values = (int32_t *) userData;
+    if (aht21->measurement.status == AHT21_OK) {
+        values[8] = aht21->measurement.humidityCenti;
+        values[9] = aht21->measurement.temperatureCenti;
+    }
+}
+
+// Acquisition and flash share one loop here, so every sector erase (tens of ms with interrupts
+// off) leaves a gap in the 100Hz sampling and the missed samples are dropped. runtime_example
+// samples on core1 instead and keeps acquiring during erases.
+void sensor_log_example() {
+    // 4 logical sectors of 32KB
+    init_flash_lib(100, 4, GROUP_BY_8);
+    SensorLog log;
+    if (!init_sensor_log(&log, 0, 4, 10, 512)) {
+        printf("Not enough memory for the sensor log\n");
+        return;
+    }
+
+    // 8 analog inputs
+    init_744051_adc();
+    C744051 c744051;
+    init_744051(&c744051, 26, NO_DISABLE_PIN, 10, 11, 12);
+
+    // Humidity and temperature
+    i2c_init(i2c0, 400000);
+    gpio_set_function(4, GPIO_FUNC_I2C);
+    gpio_set_function(5, GPIO_FUNC_I2C);
+    gpio_pull_up(4);
+    gpio_pull_up(5);
+    sleep_ms(100);
+    AHT21 aht21;
+    AHT21_init(&aht21, i2c0, AHT21_ADDRESS, AHT21_NO_SWITCH, 0);
+
+    // Measures as fast as possible, the result is copied into values from this loop
+    int32_t values[10] = {0};
+    AHT21 *sensors[1] = {&aht21};
+    AHT21Fleet fleet;
+    if (!AHT21_startFleetPolled(&fleet, sensors, 1, 0, _sensor_log_example_aht21_callback, values)) {
+        printf("Not enough memory for the AHT21 fleet\n");
+        return;
+    }
+
+    uint32_t lastSample = time_us_32();
+    uint32_t lastReport = time_us_32();
+    while (true) {
+        AHT21_pollFleet(&fleet);
+
+        // 100 samples per second
+        if (time_us_32() - lastSample >= 10000) {
+            lastSample += 10000;
+            if (time_us_32() - lastSample >= 10000) {
+                // Fell behind during an erase, drops the missed samples instead of a burst
+                lastSample = time_us_32();
+            }
+
+            uint16_t adc[8];
+            read_744051_masked(c744051, 0xFF, 1, adc, false);
+            for (uint8_t i = 0; i < 8; i++) {
+                values[i] = adc[i];
+            }
+            sensor_log_append(&log, time_us_64(), values);
+        }
+
+        sensor_log_task(&log);
+
+        if (time_us_32() - lastReport >= 5000000) {
+            lastReport += 5000000;
+
+            float bytesPerSample;
+            float samplesPerSecond;
+            get_sensor_log_stats(&log, &bytesPerSample, &samplesPerSecond);
+            printf("%.2f bytes/sample, %.1f samples/s, %u dropped, max erase %uus\n", bytesPerSample, samplesPerSecond, log.droppedSamples, log.maxEraseTime);
+
+            uint64_t now = time_us_64();
+            sensor_log_flush(&log);
+            uint32_t start = time_us_32();
+            uint32_t count = sensor_log_query(&log, now - 1000000, now, NULL, NULL);
+            printf("Last second: %u samples, query took %uus\n", count, time_us_32() - start);
+        }
+    }
+}
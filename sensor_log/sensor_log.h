@@ -0,0 +1,97 @@
+/**
+ * @brief Time-series log of sensor samples stored in flash through flash_lib.
+ *
+ * *** Pipeline ***
+ * - Samples are appended to an SRAM staging ring, this never touches flash and is safe to call from
+ *   a timer or i2c callback.
+ * - sensor_log_task() is called from the main loop, it does at most one flash operation per call:
+ *   program one full page or erase one physical sector of the segment that is written next.
+ * - Erases are done ahead of time, one 4KB sector at a time, so the staging ring only has to absorb
+ *   a single sector erase instead of a whole logical sector.
+ *
+ * *** Blocks ***
+ * - Every flash page is one block: a header followed by columns, the timestamp column first and
+ *   then one column per channel.
+ * - Columns hold the difference to the previous sample as zigzag varints, slow changing values such
+ *   as temperature or a steady ADC reading take 1 byte per sample.
+ * - The header keeps the first timestamp and the time span of the block, range queries skip blocks
+ *   without decoding them.
+ *
+ * *** Storage ***
+ * - Logical sectors firstSector to firstSector + sectorCount - 1 of flash_lib are used as a ring,
+ *   at least 2 are needed since the next one is erased ahead of time.
+ * - The first page of every physical sector is the flash_lib header, the other 15 hold blocks.
+ * - The write position is recovered on init from the block with the highest sequence number.
+ */
+
+#ifndef SENSOR_LOG_H
+#define SENSOR_LOG_H
+
+#include "pico/stdlib.h"
+#include "flash_lib_flash.h"
+
+#define SENSOR_LOG_MAX_CHANNELS 16
+#define SENSOR_LOG_MAGIC 0x4C53
+
+typedef struct SensorLogBlockHeader {
+    uint16_t magic;
+    uint8_t sampleCount;
+    uint8_t channelCount;
+    uint32_t sequence;
+    uint64_t firstTimestamp;
+    uint32_t span;  // Last timestamp - first timestamp
+    uint16_t payloadLength;
+    uint16_t checksum;  // Fletcher-16 of the payload
+} SensorLogBlockHeader;
+
+#define SENSOR_LOG_PAYLOAD_SIZE (FLASH_PAGE_SIZE - sizeof(SensorLogBlockHeader))
+#define SENSOR_LOG_PAGES_PER_SECTOR (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE - 1)
+
+typedef void (*SensorLogCallback)(uint64_t timestamp, const int32_t *values, uint8_t channelCount, void *userData);
+
+typedef struct SensorLog {
+    uint16_t firstSector;
+    uint16_t sectorCount;
+    uint8_t groupBy;
+    uint8_t channelCount;
+    uint32_t pagesPerSegment;
+    uint8_t **sectorPointers;  // XIP address of every physical sector, cached since flash_lib lookups scan headers
+
+    // Staging ring, written by sensor_log_append and read by sensor_log_task
+    uint64_t *timestamps;
+    int32_t *values;
+    uint16_t stagingCapacity;
+    volatile uint32_t stagingHead;
+    volatile uint32_t stagingTail;
+    bool flushRequested;
+
+    // Write position
+    uint16_t segment;
+    uint32_t page;
+    uint32_t sequence;
+    bool segmentReady;
+
+    // Segment being erased ahead of the write position
+    uint16_t eraseSegment;
+    uint8_t erasedSectors;
+
+    // Statistics
+    uint32_t samplesLogged;
+    uint32_t pagesWritten;
+    uint32_t sectorErases;
+    volatile uint32_t droppedSamples;
+    uint32_t maxEraseTime;
+    uint32_t lastStatsTime;
+    uint32_t lastSamplesLogged;
+    uint32_t lastPagesWritten;
+} SensorLog;
+
+bool init_sensor_log(SensorLog *log, uint16_t firstSector, uint16_t sectorCount, uint8_t channelCount, uint16_t stagingCapacity);
+bool sensor_log_append(SensorLog *log, uint64_t timestamp, const int32_t *values);
+bool sensor_log_task(SensorLog *log);
+void sensor_log_flush(SensorLog *log);
+uint32_t sensor_log_query(SensorLog *log, uint64_t from, uint64_t to, SensorLogCallback callback, void *userData);
+void get_sensor_log_stats(SensorLog *log, float *bytesPerSample, float *samplesPerSecond);
+void sensor_log_example();
+
+#endif
@@ -1,11 +1,17 @@
+#include <stdlib.h>
+#include <string.h>
 #include "shift_register.h"
+#include "trace.h"
+#include "trace_systick.h"
 
-// SIPO
-// Max freq. 41.666MHz
-// Recommended freq:
-// 74HC164 - 10MHz
-// 74HC595 - 41.666MHz
-void init_out_shift_register(ShiftRegister *shiftRegister, uint offset, float clock) {
+ShiftRegister *_dma_shift_registers[NUM_PIOS][NUM_PIO_STATE_MACHINES];
+bool _dma_irq_installed[NUM_PIOS];
+ShiftRegisterDisplay *_displays[NUM_DMA_CHANNELS];
+bool _display_irq_installed;
+ShiftRegisterScanner *_scanners[NUM_DMA_CHANNELS];
+bool _scanner_irq_installed;
+
+void _init_out_shift_register(ShiftRegister *shiftRegister, uint offset, float clock, uint8_t fifoBits) {
     PIO pio = shiftRegister->pio;
     uint sm = shiftRegister->sm;
 
@@ -25,19 +31,16 @@ void init_out_shift_register(ShiftRegister *shiftRegister, uint offset, float cl
     sm_config_set_sideset_pins(&c, shiftRegister->clockPin);
     pio_sm_set_consecutive_pindirs(pio, shiftRegister->sm, shiftRegister->clockPin, 1, true);
 
-    sm_config_set_in_shift(&c, false, true, 8);
-    sm_config_set_out_shift(&c, true, true, 8);
+    shiftRegister->fifoBits = fifoBits;
+    sm_config_set_in_shift(&c, false, true, fifoBits);
+    sm_config_set_out_shift(&c, true, true, fifoBits);
 
     sm_config_set_clkdiv(&c, clockDiv);
     pio_sm_init(pio, sm, offset, &c);
     pio_sm_set_enabled(pio, sm, true);
 }
 
-// PISO
-// Max freq. 41.666MHz
-// Recommended freq:
-// 74HC165 - 10MHz
-void init_in_shift_register(ShiftRegister *shiftRegister, uint offset, float clock) {
+void _init_in_shift_register(ShiftRegister *shiftRegister, uint offset, float clock, uint8_t fifoBits) {
     PIO pio = shiftRegister->pio;
     uint sm = shiftRegister->sm;
 
@@ -57,19 +60,74 @@ void init_in_shift_register(ShiftRegister *shiftRegister, uint offset, float clo
     sm_config_set_sideset_pins(&c, shiftRegister->clockPin);
     pio_sm_set_consecutive_pindirs(pio, sm, shiftRegister->clockPin, 1, true);
 
-    sm_config_set_in_shift(&c, false, true, 8);
-    sm_config_set_out_shift(&c, true, true, 8);
+    shiftRegister->fifoBits = fifoBits;
+    sm_config_set_in_shift(&c, false, true, fifoBits);
+    sm_config_set_out_shift(&c, true, true, fifoBits);
 
     sm_config_set_clkdiv(&c, clockDiv);
     pio_sm_init(pio, sm, offset, &c);
     pio_sm_set_enabled(pio, sm, true);
 }
 
+// SIPO
+// Max freq. 41.666MHz
+// Recommended freq:
+// 74HC164 - 10MHz
+// 74HC595 - 41.666MHz
+void init_out_shift_register(ShiftRegister *shiftRegister, uint offset, float clock) {
+    _init_out_shift_register(shiftRegister, offset, clock, 8);
+}
+
+// Same as init_out_shift_register but moves 32 bits per FIFO operation,
+// recommended for long chains.
+void init_out_shift_register_words(ShiftRegister *shiftRegister, uint offset, float clock) {
+    _init_out_shift_register(shiftRegister, offset, clock, 32);
+}
+
+// PISO
+// Max freq. 41.666MHz
+// Recommended freq:
+// 74HC165 - 10MHz
+void init_in_shift_register(ShiftRegister *shiftRegister, uint offset, float clock) {
+    _init_in_shift_register(shiftRegister, offset, clock, 8);
+}
+
+// Same as init_in_shift_register but moves 32 bits per FIFO operation,
+// recommended for long chains.
+void init_in_shift_register_words(ShiftRegister *shiftRegister, uint offset, float clock) {
+    _init_in_shift_register(shiftRegister, offset, clock, 32);
+}
+
+// Packs the bytes in shifting order, last register first and LSB first.
+// When registerCount is not a multiple of 4 the first word is padded, the padding
+// bits are shifted first so they fall off the end of the chain.
+void __time_critical_func(_write_words_to_shift_register)(ShiftRegister *shiftRegister, uint8_t *dataArray) {
+    uint16_t wordCount = (shiftRegister->registerCount + 3) / 4;
+    int32_t i = wordCount * 4 - 1;
+
+    for (uint16_t w = 0; w < wordCount; w++) {
+        uint32_t word = 0;
+        for (uint8_t j = 0; j < 4; j++, i--) {
+            if (i < shiftRegister->registerCount) {
+                word |= (uint32_t) dataArray[i] << (8 * j);
+            }
+        }
+
+        pio_sm_put_blocking(shiftRegister->pio, shiftRegister->sm, word);
+        pio_sm_get(shiftRegister->pio, shiftRegister->sm);
+    }
+}
+
 // 0bABCDEFGH -> output
 void __time_critical_func(write_to_shift_register)(ShiftRegister *shiftRegister, uint8_t *dataArray) {
-    for (uint8_t i = shiftRegister->registerCount; i > 0; i--) {
-        pio_sm_put_blocking(shiftRegister->pio, shiftRegister->sm, dataArray[i-1]);
-        pio_sm_get(shiftRegister->pio, shiftRegister->sm);
+    TRACE_BEGIN(TRACE_SHIFT_REGISTER_TRANSFER);
+    if (shiftRegister->fifoBits == 32) {
+        _write_words_to_shift_register(shiftRegister, dataArray);
+    } else {
+        for (uint16_t i = shiftRegister->registerCount; i > 0; i--) {
+            pio_sm_put_blocking(shiftRegister->pio, shiftRegister->sm, dataArray[i-1]);
+            pio_sm_get(shiftRegister->pio, shiftRegister->sm);
+        }
     }
 
     uint32_t SM_STALL_MASK = 1u << (PIO_FDEBUG_TXSTALL_LSB + shiftRegister->sm);
@@ -83,18 +141,915 @@ void __time_critical_func(write_to_shift_register)(ShiftRegister *shiftRegister,
     gpio_put(shiftRegister->updateData, 1);
     for(int i = 0; i < 1; i++);
     gpio_put(shiftRegister->updateData, 0);
+    TRACE_END(TRACE_SHIFT_REGISTER_TRANSFER);
+}
+
+// The first bit read ends up on the MSB, so the first register is the highest byte of each word.
+// The extra bits clocked in on the last word when registerCount is not a multiple of 4 are dropped.
+void __time_critical_func(_read_words_from_shift_register)(ShiftRegister *shiftRegister, uint8_t dataArray[]) {
+    uint16_t wordCount = (shiftRegister->registerCount + 3) / 4;
+    uint16_t i = 0;
+
+    for (uint16_t w = 0; w < wordCount; w++) {
+        pio_sm_put(shiftRegister->pio, shiftRegister->sm, 0xFFFFFFFF);
+        uint32_t word = pio_sm_get_blocking(shiftRegister->pio, shiftRegister->sm);
+
+        for (uint8_t j = 0; j < 4 && i < shiftRegister->registerCount; j++, i++) {
+            dataArray[i] = word >> (24 - 8 * j);
+        }
+    }
 }
 
 // 0bHGFEDCBA <- input
 void __time_critical_func(read_from_shift_register)(ShiftRegister *shiftRegister, uint8_t dataArray[]) {
+    TRACE_BEGIN(TRACE_SHIFT_REGISTER_TRANSFER);
     gpio_put(shiftRegister->updateData, 0);
     for(int i = 0; i < 1; i++);
     gpio_put(shiftRegister->updateData, 1);
 
-    for (uint8_t i = 0; i < shiftRegister->registerCount; i++) {
+    if (shiftRegister->fifoBits == 32) {
+        _read_words_from_shift_register(shiftRegister, dataArray);
+        TRACE_END(TRACE_SHIFT_REGISTER_TRANSFER);
+        return;
+    }
+
+    for (uint16_t i = 0; i < shiftRegister->registerCount; i++) {
         pio_sm_put(shiftRegister->pio, shiftRegister->sm, 0xFF);
         dataArray[i] = pio_sm_get_blocking(shiftRegister->pio, shiftRegister->sm);
     }
+    TRACE_END(TRACE_SHIFT_REGISTER_TRANSFER);
+}
+
+void _init_duplex_shift_register(ShiftRegister *shiftRegister, uint offset, float clock, uint8_t fifoBits) {
+    PIO pio = shiftRegister->pio;
+    uint sm = shiftRegister->sm;
+
+    clock *= 3;
+    float clockDiv = (float) clock_get_hz(clk_sys) / clock;
+    pio_sm_config c = shift_register_program_get_default_config(offset);
+
+    gpio_init(shiftRegister->updateData);
+    gpio_set_dir(shiftRegister->updateData, true);
+    gpio_put(shiftRegister->updateData, 0);
+
+    gpio_init(shiftRegister->loadPin);
+    gpio_set_dir(shiftRegister->loadPin, true);
+    gpio_put(shiftRegister->loadPin, 1);
+
+    pio_gpio_init(pio, shiftRegister->dataPin);
+    pio_gpio_init(pio, shiftRegister->inputPin);
+    pio_gpio_init(pio, shiftRegister->clockPin);
+
+    sm_config_set_out_pins(&c, shiftRegister->dataPin, 1);
+    pio_sm_set_consecutive_pindirs(pio, sm, shiftRegister->dataPin, 1, true);
+    sm_config_set_in_pins(&c, shiftRegister->inputPin);
+    pio_sm_set_consecutive_pindirs(pio, sm, shiftRegister->inputPin, 1, false);
+    sm_config_set_sideset_pins(&c, shiftRegister->clockPin);
+    pio_sm_set_consecutive_pindirs(pio, sm, shiftRegister->clockPin, 1, true);
+
+    shiftRegister->fifoBits = fifoBits;
+    sm_config_set_in_shift(&c, false, true, fifoBits);
+    sm_config_set_out_shift(&c, true, true, fifoBits);
+
+    sm_config_set_clkdiv(&c, clockDiv);
+    pio_sm_init(pio, sm, offset, &c);
+    pio_sm_set_enabled(pio, sm, true);
+}
+
+// SIPO + PISO sharing the clock, for example a 74HC595 chain and a 74HC165 chain on the same board
+// dataPin -> 74HC595 SER, inputPin <- 74HC165 QH
+// updateData -> 74HC595 RCLK, loadPin -> 74HC165 /PL
+// registerCount is the number of output registers, inputRegisterCount the number of input registers.
+// Max freq. is the lowest of both chains, 10MHz for the 74HC165.
+void init_duplex_shift_register(ShiftRegister *shiftRegister, uint offset, float clock) {
+    _init_duplex_shift_register(shiftRegister, offset, clock, 8);
+}
+
+// Same as init_duplex_shift_register but moves 32 bits per FIFO operation,
+// recommended for long chains.
+void init_duplex_shift_register_words(ShiftRegister *shiftRegister, uint offset, float clock) {
+    _init_duplex_shift_register(shiftRegister, offset, clock, 32);
+}
+
+// 0bABCDEFGH -> output, 0bHGFEDCBA <- input
+// Loads the inputs, then clocks the outputs out while the inputs are clocked in and latches the outputs.
+// The chain with less registers is padded, output padding is shifted first so it falls off the end
+// of the chain and the extra input bits are dropped.
+void __time_critical_func(transfer_shift_register)(ShiftRegister *shiftRegister, uint8_t *outData, uint8_t inData[]) {
+    uint8_t bytesPerWord = shiftRegister->fifoBits / 8;
+    uint16_t registerCount = MAX(shiftRegister->registerCount, shiftRegister->inputRegisterCount);
+    uint16_t wordCount = (registerCount + bytesPerWord - 1) / bytesPerWord;
+    int32_t outIndex = wordCount * bytesPerWord - 1;
+    uint16_t inIndex = 0;
+
+    TRACE_BEGIN(TRACE_SHIFT_REGISTER_TRANSFER);
+    gpio_put(shiftRegister->loadPin, 0);
+    for(int i = 0; i < 1; i++);
+    gpio_put(shiftRegister->loadPin, 1);
+
+    for (uint16_t w = 0; w < wordCount; w++) {
+        uint32_t word = 0;
+        for (uint8_t j = 0; j < bytesPerWord; j++, outIndex--) {
+            if (outIndex < shiftRegister->registerCount) {
+                word |= (uint32_t) outData[outIndex] << (8 * j);
+            }
+        }
+
+        pio_sm_put_blocking(shiftRegister->pio, shiftRegister->sm, word);
+        uint32_t received = pio_sm_get_blocking(shiftRegister->pio, shiftRegister->sm);
+
+        for (uint8_t j = 0; j < bytesPerWord && inIndex < shiftRegister->inputRegisterCount; j++, inIndex++) {
+            inData[inIndex] = received >> (shiftRegister->fifoBits - 8 - 8 * j);
+        }
+    }
+
+    // The last bit was clocked in with the clock high, so it is also on the outputs' shift register
+    gpio_put(shiftRegister->updateData, 1);
+    for(int i = 0; i < 1; i++);
+    gpio_put(shiftRegister->updateData, 0);
+    TRACE_END(TRACE_SHIFT_REGISTER_TRANSFER);
+}
+
+void __time_critical_func(_shift_register_dma_irq_handler)() {
+    for (uint pio_index = 0; pio_index < NUM_PIOS; pio_index++) {
+        PIO pio = pio_index == 0 ? pio0 : pio1;
+
+        for (uint sm = 0; sm < NUM_PIO_STATE_MACHINES; sm++) {
+            ShiftRegister *shiftRegister = _dma_shift_registers[pio_index][sm];
+            if (shiftRegister == NULL || !pio_interrupt_get(pio, sm)) {
+                continue;
+            }
+
+            pio_interrupt_clear(pio, sm);
+            shiftRegister->busy = false;
+            if (shiftRegister->callback != NULL) {
+                shiftRegister->callback(shiftRegister);
+            }
+        }
+    }
+}
+
+bool _init_out_shift_register_dma(ShiftRegister *shiftRegister, pio_sm_config c, uint offset, float clock, ShiftRegisterCallback callback, uint8_t fifoBits, uint8_t dataPinCount, uint32_t bufferWords) {
+    PIO pio = shiftRegister->pio;
+    uint sm = shiftRegister->sm;
+    uint pio_index = pio_get_index(pio);
+
+    // Init again, the previous buffer and DMA channel are released first
+    if (_dma_shift_registers[pio_index][sm] == shiftRegister) {
+        deinit_shift_register_dma(shiftRegister);
+    }
+
+    shiftRegister->dmaBuffer = (uint32_t *) malloc(bufferWords * sizeof(uint32_t));
+    if (shiftRegister->dmaBuffer == NULL) {
+        return false;
+    }
+
+    clock *= 3;
+    float clockDiv = (float) clock_get_hz(clk_sys) / clock;
+
+    for (uint8_t i = 0; i < dataPinCount; i++) {
+        pio_gpio_init(pio, shiftRegister->dataPin + i);
+    }
+    pio_gpio_init(pio, shiftRegister->clockPin);
+    pio_gpio_init(pio, shiftRegister->updateData);
+
+    sm_config_set_out_pins(&c, shiftRegister->dataPin, dataPinCount);
+    pio_sm_set_consecutive_pindirs(pio, sm, shiftRegister->dataPin, dataPinCount, true);
+    sm_config_set_sideset_pins(&c, shiftRegister->clockPin);
+    pio_sm_set_consecutive_pindirs(pio, sm, shiftRegister->clockPin, 1, true);
+    sm_config_set_set_pins(&c, shiftRegister->updateData, 1);
+    pio_sm_set_consecutive_pindirs(pio, sm, shiftRegister->updateData, 1, true);
+    pio_sm_set_pins_with_mask(pio, sm, 0, 1u << shiftRegister->updateData);
+
+    // Output only, so the RX FIFO is given to TX
+    shiftRegister->fifoBits = fifoBits;
+    sm_config_set_out_shift(&c, true, true, fifoBits);
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
+
+    sm_config_set_clkdiv(&c, clockDiv);
+    pio_sm_init(pio, sm, offset, &c);
+
+    // Bytes are replicated across the bus, in byte mode the PIO only shifts the lowest 8 bits
+    shiftRegister->dmaChannel = dma_claim_unused_channel(true);
+    dma_channel_config dmaConfig = dma_channel_get_default_config(shiftRegister->dmaChannel);
+    channel_config_set_transfer_data_size(&dmaConfig, fifoBits == 32 ? DMA_SIZE_32 : DMA_SIZE_8);
+    channel_config_set_read_increment(&dmaConfig, true);
+    channel_config_set_write_increment(&dmaConfig, false);
+    channel_config_set_dreq(&dmaConfig, pio_get_dreq(pio, sm, true));
+    dma_channel_configure(shiftRegister->dmaChannel, &dmaConfig, &pio->txf[sm], NULL, 0, false);
+
+    shiftRegister->busy = false;
+    shiftRegister->callback = callback;
+    _dma_shift_registers[pio_index][sm] = shiftRegister;
+
+    // irq 0 rel raises flag <sm>
+    pio_interrupt_clear(pio, sm);
+    pio_set_irq0_source_enabled(pio, pis_interrupt0 + sm, true);
+    if (!_dma_irq_installed[pio_index]) {
+        uint irq = pio_index == 0 ? PIO0_IRQ_0 : PIO1_IRQ_0;
+        irq_add_shared_handler(irq, _shift_register_dma_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+        irq_set_enabled(irq, true);
+        _dma_irq_installed[pio_index] = true;
+    }
+
+    pio_sm_set_enabled(pio, sm, true);
+    return true;
+}
+
+// SIPO, DMA fed
+// Uses shift_register_latch_program, the latch pulse is generated by the PIO after the
+// last bit so updateData can be any pin.
+// callback is called from the PIO IRQ once the data is latched, pass NULL to only poll.
+// Returns false if the DMA buffer can't be allocated.
+bool init_out_shift_register_dma(ShiftRegister *shiftRegister, uint offset, float clock, ShiftRegisterCallback callback) {
+    pio_sm_config c = shift_register_latch_program_get_default_config(offset);
+    return _init_out_shift_register_dma(shiftRegister, c, offset, clock, callback, 8, 1, (shiftRegister->registerCount + 3) / 4);
+}
+
+// Same as init_out_shift_register_dma but the DMA moves 32 bit words, a quarter of the
+// bus and FIFO operations.
+bool init_out_shift_register_dma_words(ShiftRegister *shiftRegister, uint offset, float clock, ShiftRegisterCallback callback) {
+    pio_sm_config c = shift_register_latch_program_get_default_config(offset);
+    return _init_out_shift_register_dma(shiftRegister, c, offset, clock, callback, 32, 1, (shiftRegister->registerCount + 3) / 4);
+}
+
+// Stops a DMA fed shift register (serial or parallel) once its transfer is done, unclaims the DMA
+// channel and frees the DMA buffer. The state machine stays claimed.
+void deinit_shift_register_dma(ShiftRegister *shiftRegister) {
+    PIO pio = shiftRegister->pio;
+    uint sm = shiftRegister->sm;
+
+    wait_for_shift_register_dma(shiftRegister);
+    pio_sm_set_enabled(pio, sm, false);
+    pio_set_irq0_source_enabled(pio, pis_interrupt0 + sm, false);
+    pio_interrupt_clear(pio, sm);
+    _dma_shift_registers[pio_get_index(pio)][sm] = NULL;
+
+    dma_channel_abort(shiftRegister->dmaChannel);
+    dma_channel_unclaim(shiftRegister->dmaChannel);
+    free(shiftRegister->dmaBuffer);
+    shiftRegister->dmaBuffer = NULL;
+}
+
+// 0bABCDEFGH -> output
+// Same register order as write_to_shift_register. dataArray is copied last register first into
+// the DMA buffer, the padding of the last word is never shifted out.
+// Returns right away, dataArray can be reused as soon as this returns.
+void __time_critical_func(write_to_shift_register_dma)(ShiftRegister *shiftRegister, const uint8_t *dataArray) {
+    wait_for_shift_register_dma(shiftRegister);
+
+    TRACE_BEGIN(TRACE_SHIFT_REGISTER_DMA_START);
+    uint8_t *buffer = (uint8_t *) shiftRegister->dmaBuffer;
+    for (uint16_t i = 0; i < shiftRegister->registerCount; i++) {
+        buffer[i] = dataArray[shiftRegister->registerCount - 1 - i];
+    }
+
+    uint32_t transferCount = shiftRegister->registerCount;
+    if (shiftRegister->fifoBits == 32) {
+        transferCount = (transferCount + 3) / 4;
+    }
+
+    shiftRegister->busy = true;
+    pio_sm_put(shiftRegister->pio, shiftRegister->sm, shiftRegister->registerCount * 8 - 1);
+    dma_channel_transfer_from_buffer_now(shiftRegister->dmaChannel, shiftRegister->dmaBuffer, transferCount);
+    TRACE_END(TRACE_SHIFT_REGISTER_DMA_START);
+}
+
+// Parallel SIPO, DMA fed
+// Drives chainCount (1-8) chains with one state machine, chain n uses dataPin + n as data pin,
+// clockPin and updateData are shared by all chains.
+// Uses shift_register_parallel_program, every chain must have registerCount registers.
+// Returns false if chainCount is out of range or the DMA buffer can't be allocated.
+bool init_parallel_shift_register(ShiftRegister *shiftRegister, uint offset, float clock, ShiftRegisterCallback callback) {
+    if (shiftRegister->chainCount < 1 || shiftRegister->chainCount > 8) {
+        return false;
+    }
+
+    pio_sm_config c = shift_register_parallel_program_get_default_config(offset);
+    // 8 bytes per register, one per clock
+    return _init_out_shift_register_dma(shiftRegister, c, offset, clock, callback, 32, shiftRegister->chainCount, shiftRegister->registerCount * 2);
+}
+
+/**
+ * @brief Transposes an 8x8 bit matrix, bit b of rows[c] becomes bit c of byte b.
+ *
+ * @param[in] rows 8 bytes, one per chain.
+ * @param[out] words 2 words holding the 8 transposed bytes, byte 0 on the LSB of words[0].
+ */
+void __time_critical_func(_transpose_8x8)(const uint8_t *rows, uint32_t *words) {
+    uint32_t x = rows[0] | (rows[1] << 8) | (rows[2] << 16) | ((uint32_t) rows[3] << 24);
+    uint32_t y = rows[4] | (rows[5] << 8) | (rows[6] << 16) | ((uint32_t) rows[7] << 24);
+    uint32_t t;
+
+    // Swaps 2x2 blocks, then 2x2 blocks of 2x2 blocks inside each 4x4 block
+    t = (x ^ (x >> 7)) & 0x00AA00AA;
+    x ^= t ^ (t << 7);
+    t = (y ^ (y >> 7)) & 0x00AA00AA;
+    y ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC;
+    x ^= t ^ (t << 14);
+    t = (y ^ (y >> 14)) & 0x0000CCCC;
+    y ^= t ^ (t << 14);
+
+    // Swaps the top right and bottom left 4x4 blocks
+    t = (x & 0x0F0F0F0F) | ((y << 4) & 0xF0F0F0F0);
+    y = (y & 0xF0F0F0F0) | ((x >> 4) & 0x0F0F0F0F);
+
+    words[0] = t;
+    words[1] = y;
+}
+
+// 0bABCDEFGH -> output
+// chains[n] holds registerCount bytes for chain n, in the same order as write_to_shift_register.
+// The data is transposed into the DMA buffer so chains can be reused as soon as this returns.
+void __time_critical_func(write_to_parallel_shift_register)(ShiftRegister *shiftRegister, uint8_t *chains[]) {
+    wait_for_shift_register_dma(shiftRegister);
+
+    TRACE_BEGIN(TRACE_SHIFT_REGISTER_DMA_START);
+    uint8_t rows[8] = {0};
+    uint32_t *buffer = shiftRegister->dmaBuffer;
+    for (uint16_t i = shiftRegister->registerCount; i > 0; i--) {
+        for (uint8_t chain = 0; chain < shiftRegister->chainCount; chain++) {
+            rows[chain] = chains[chain][i-1];
+        }
+        _transpose_8x8(rows, buffer);
+        buffer += 2;
+    }
+
+    shiftRegister->busy = true;
+    pio_sm_put(shiftRegister->pio, shiftRegister->sm, shiftRegister->registerCount * 8 - 1);
+    dma_channel_transfer_from_buffer_now(shiftRegister->dmaChannel, shiftRegister->dmaBuffer, shiftRegister->registerCount * 2);
+    TRACE_END(TRACE_SHIFT_REGISTER_DMA_START);
+}
+
+// True until the last bit was shifted and latched
+bool shift_register_dma_busy(ShiftRegister *shiftRegister) {
+    return shiftRegister->busy;
+}
+
+void wait_for_shift_register_dma(ShiftRegister *shiftRegister) {
+    while (shiftRegister->busy) {
+        tight_loop_contents();
+    }
+}
+
+void __time_critical_func(_shift_register_display_irq_handler)() {
+    uint32_t start = systick_hw->cvr;
+
+    for (uint channel = 0; channel < NUM_DMA_CHANNELS; channel++) {
+        ShiftRegisterDisplay *display = _displays[channel];
+        if (display == NULL || !dma_channel_get_irq1_status(channel)) {
+            continue;
+        }
+        dma_channel_acknowledge_irq1(channel);
+        display->frameCount++;
+
+        // The swap is done once the data channel is reading from the new frame
+        uint32_t readAddress = dma_channel_hw_addr(display->shiftRegister->dmaChannel)->read_addr;
+        uint32_t frameStart = (uint32_t) display->nextFrame;
+        if (display->swapPending && readAddress >= frameStart && readAddress <= frameStart + display->frameWords * sizeof(uint32_t)) {
+            display->swapPending = false;
+        }
+        display->irqCycles += (start - systick_hw->cvr) & SYSTICK_MASK;
+    }
+}
+
+/**
+ * @brief Starts refreshing a 74HC595 chain continuously using binary code modulation.
+ *
+ * Every output has its own brightness level, the frame is split into brightnessBits bit planes and
+ * plane n is shown for 2^n time units. The PIO shifts and latches each plane with the outputs disabled and
+ * then enables them for the plane's on time. A second DMA channel restarts the data channel at the end of
+ * every frame, so the CPU is only used when swapping frames and by a short IRQ per frame.
+ *
+ * Uses shift_register_bcm_program. /OE of the chain must be connected to updateData + 1.
+ *
+ * @param[in] display Display to initialize.
+ * @param[in] shiftRegister Shift register with pio, sm, pins and registerCount configured.
+ * @param[in] offset Offset of shift_register_bcm_program.
+ * @param[in] clock Shift clock, same limits as init_out_shift_register.
+ * @param[in] brightnessBits Brightness resolution (4-8), the top bits of each framebuffer value are used.
+ * @param[in] refreshRate Frames per second, must leave room to shift every plane.
+ *
+ * @return false if brightnessBits is out of range, refreshRate leaves no time to show the planes or the
+ * frames can't be allocated.
+ */
+bool init_shift_register_display(ShiftRegisterDisplay *display, ShiftRegister *shiftRegister, uint offset, float clock, uint8_t brightnessBits, float refreshRate) {
+    if (brightnessBits < 4 || brightnessBits > 8) {
+        return false;
+    }
+
+    PIO pio = shiftRegister->pio;
+    uint sm = shiftRegister->sm;
+    uint16_t wordCount = (shiftRegister->registerCount + 3) / 4;
+
+    // Time unit of the least significant plane, in PIO cycles
+    clock *= 3;
+    uint32_t frameCycles = clock / refreshRate;
+    uint32_t planeShiftCycles = wordCount * 32 * 3 + 7;
+    if (frameCycles <= brightnessBits * planeShiftCycles) {
+        return false;
+    }
+    uint32_t unitCycles = (frameCycles - brightnessBits * planeShiftCycles) / ((1u << brightnessBits) - 1);
+    if (unitCycles == 0) {
+        return false;
+    }
+
+    display->shiftRegister = shiftRegister;
+    display->brightnessBits = brightnessBits;
+    display->wordCount = wordCount;
+    display->frameWords = brightnessBits * (2 + wordCount);
+    display->framebuffer = (uint8_t *) calloc(shiftRegister->registerCount * 8, sizeof(uint8_t));
+    display->frames[0] = (uint32_t *) calloc(display->frameWords, sizeof(uint32_t));
+    display->frames[1] = (uint32_t *) calloc(display->frameWords, sizeof(uint32_t));
+    if (display->framebuffer == NULL || display->frames[0] == NULL || display->frames[1] == NULL) {
+        free(display->framebuffer);
+        free(display->frames[0]);
+        free(display->frames[1]);
+        return false;
+    }
+    display->backFrame = 1;
+    display->nextFrame = display->frames[0];
+    display->swapPending = false;
+    display->frameCount = 0;
+    display->irqCycles = 0;
+    display->lastFrameCount = 0;
+    display->lastIrqCycles = 0;
+    display->lastStatsTime = time_us_32();
+
+    // The IRQ runs on this core, its SysTick is started if nothing else uses it
+    start_systick();
+
+    for (uint8_t frame = 0; frame < 2; frame++) {
+        for (uint8_t plane = 0; plane < brightnessBits; plane++) {
+            uint32_t *header = display->frames[frame] + plane * (2 + display->wordCount);
+            header[0] = display->wordCount * 32 - 1;
+            header[1] = (unitCycles << plane) - 1;
+        }
+    }
+
+    float clockDiv = (float) clock_get_hz(clk_sys) / clock;
+    pio_sm_config c = shift_register_bcm_program_get_default_config(offset);
+
+    pio_gpio_init(pio, shiftRegister->dataPin);
+    pio_gpio_init(pio, shiftRegister->clockPin);
+    pio_gpio_init(pio, shiftRegister->updateData);
+    pio_gpio_init(pio, shiftRegister->updateData + 1);
+
+    sm_config_set_out_pins(&c, shiftRegister->dataPin, 1);
+    pio_sm_set_consecutive_pindirs(pio, sm, shiftRegister->dataPin, 1, true);
+    sm_config_set_sideset_pins(&c, shiftRegister->clockPin);
+    pio_sm_set_consecutive_pindirs(pio, sm, shiftRegister->clockPin, 1, true);
+    sm_config_set_set_pins(&c, shiftRegister->updateData, 2);
+    pio_sm_set_consecutive_pindirs(pio, sm, shiftRegister->updateData, 2, true);
+    // Latch low, outputs disabled
+    pio_sm_set_pins_with_mask(pio, sm, 0b10u << shiftRegister->updateData, 0b11u << shiftRegister->updateData);
+
+    shiftRegister->fifoBits = 32;
+    sm_config_set_out_shift(&c, true, true, 32);
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
+
+    sm_config_set_clkdiv(&c, clockDiv);
+    pio_sm_init(pio, sm, offset, &c);
+
+    // Data channel streams one frame, then chains to the control channel which
+    // reloads its read address from nextFrame and triggers it again
+    shiftRegister->dmaChannel = dma_claim_unused_channel(true);
+    display->controlChannel = dma_claim_unused_channel(true);
+
+    dma_channel_config dataConfig = dma_channel_get_default_config(shiftRegister->dmaChannel);
+    channel_config_set_transfer_data_size(&dataConfig, DMA_SIZE_32);
+    channel_config_set_read_increment(&dataConfig, true);
+    channel_config_set_write_increment(&dataConfig, false);
+    channel_config_set_dreq(&dataConfig, pio_get_dreq(pio, sm, true));
+    channel_config_set_chain_to(&dataConfig, display->controlChannel);
+    dma_channel_configure(shiftRegister->dmaChannel, &dataConfig, &pio->txf[sm], display->frames[0], display->frameWords, false);
+
+    dma_channel_config controlConfig = dma_channel_get_default_config(display->controlChannel);
+    channel_config_set_transfer_data_size(&controlConfig, DMA_SIZE_32);
+    channel_config_set_read_increment(&controlConfig, false);
+    channel_config_set_write_increment(&controlConfig, false);
+    dma_channel_configure(display->controlChannel, &controlConfig,
+        &dma_channel_hw_addr(shiftRegister->dmaChannel)->al3_read_addr_trig, &display->nextFrame, 1, false);
+
+    _displays[display->controlChannel] = display;
+    dma_channel_set_irq1_enabled(display->controlChannel, true);
+    if (!_display_irq_installed) {
+        irq_add_shared_handler(DMA_IRQ_1, _shift_register_display_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+        irq_set_enabled(DMA_IRQ_1, true);
+        _display_irq_installed = true;
+    }
+
+    pio_sm_set_enabled(pio, sm, true);
+    dma_channel_start(display->controlChannel);
+    return true;
+}
+
+/**
+ * @brief Encodes the framebuffer into the back frame and shows it at the start of the next frame.
+ *
+ * framebuffer[n] is the brightness of output n, output n is bit n % 8 of register n / 8 using the
+ * same register order as write_to_shift_register.
+ * Waits for the previous swap to be shown first, so a frame is never changed while it is displayed.
+ *
+ * @param[in] display Display to update.
+ */
+void __time_critical_func(swap_shift_register_display)(ShiftRegisterDisplay *display) {
+    while (display->swapPending) {
+        tight_loop_contents();
+    }
+
+    uint16_t registerCount = display->shiftRegister->registerCount;
+    uint32_t *frame = display->frames[display->backFrame];
+    uint32_t stride = 2 + display->wordCount;
+
+    // Transposing 8 brightness values gives the byte of each bit plane for that register
+    uint32_t planes[2];
+    uint8_t *planeBytes = (uint8_t *) planes;
+    for (uint16_t i = 0; i < registerCount; i++) {
+        _transpose_8x8(&display->framebuffer[i * 8], planes);
+
+        // Same word packing as write_to_shift_register, last register first
+        uint32_t position = display->wordCount * 4 - 1 - i;
+        for (uint8_t plane = 0; plane < display->brightnessBits; plane++) {
+            uint8_t *planeData = (uint8_t *) (frame + plane * stride + 2);
+            planeData[position] = planeBytes[8 - display->brightnessBits + plane];
+        }
+    }
+
+    // nextFrame must be visible before swapPending, or the IRQ could match the previous frame
+    // and end the swap while the DMA is still reading the frame written next
+    display->nextFrame = frame;
+    __dmb();
+    display->swapPending = true;
+    display->backFrame ^= 1;
+}
+
+/**
+ * @brief Measures the refresh rate and the CPU time spent on the frame IRQ since the last call.
+ *
+ * @param[in] display Display to measure.
+ * @param[out] refreshRate Frames per second.
+ * @param[out] cpuLoad Fraction of CPU time used by the display IRQ (0-1).
+ */
+void get_shift_register_display_stats(ShiftRegisterDisplay *display, float *refreshRate, float *cpuLoad) {
+    uint32_t now = time_us_32();
+    uint32_t frameCount = display->frameCount;
+    uint32_t irqCycles = display->irqCycles;
+    uint32_t elapsed = now - display->lastStatsTime;
+
+    *refreshRate = (float) (frameCount - display->lastFrameCount) * 1000000 / elapsed;
+    *cpuLoad = (float) (irqCycles - display->lastIrqCycles) / ((float) elapsed * clock_get_hz(clk_sys) / 1000000);
+
+    display->lastStatsTime = now;
+    display->lastFrameCount = frameCount;
+    display->lastIrqCycles = irqCycles;
+}
+
+bool _shift_register_scanner_timer_callback(repeating_timer_t *timer) {
+    ShiftRegisterScanner *scanner = (ShiftRegisterScanner *) timer->user_data;
+    ShiftRegister *shiftRegister = scanner->shiftRegister;
+
+    pio_sm_put(shiftRegister->pio, shiftRegister->sm, scanner->wordCount * 32 - 1);
+    return true;
+}
+
+void __time_critical_func(_push_shift_register_event)(ShiftRegisterScanner *scanner, uint32_t input, bool rising, uint32_t scanTime) {
+    uint32_t head = scanner->eventHead;
+    if (head - scanner->eventTail == SHIFT_REGISTER_EVENT_QUEUE_SIZE) {
+        scanner->droppedEvents++;
+        return;
+    }
+
+    ShiftRegisterEvent *event = &scanner->events[head % SHIFT_REGISTER_EVENT_QUEUE_SIZE];
+    event->timestamp = scanTime;
+    event->input = input;
+    event->rising = rising;
+
+    // Event must be written before it is published
+    __dmb();
+    scanner->eventHead = head + 1;
+}
+
+/**
+ * @brief Debounces one scan with 2 bit vertical counters, all 32 bits of a word are handled at once.
+ *
+ * A bit only toggles after 4 consecutive scans different from the debounced state.
+ * scanTime is the time the scan completed, every edge it confirms is stamped with it.
+ */
+void __time_critical_func(_debounce_shift_register_scan)(ShiftRegisterScanner *scanner, uint32_t scanTime) {
+    uint32_t inputCount = scanner->shiftRegister->registerCount * 8;
+
+    for (uint16_t w = 0; w < scanner->wordCount; w++) {
+        uint32_t sample = scanner->samples[w];
+
+        // First scan is taken as is, counters start at their idle value
+        if (!scanner->primed) {
+            scanner->state[w] = sample;
+            scanner->counter0[w] = 0xFFFFFFFF;
+            scanner->counter1[w] = 0xFFFFFFFF;
+            continue;
+        }
+
+        uint32_t changed = scanner->state[w] ^ sample;
+        scanner->counter0[w] = ~(scanner->counter0[w] & changed);
+        scanner->counter1[w] = scanner->counter0[w] ^ (scanner->counter1[w] & changed);
+        uint32_t toggled = changed & scanner->counter0[w] & scanner->counter1[w];
+        scanner->state[w] ^= toggled;
+
+        while (toggled) {
+            uint8_t bit = __builtin_ctz(toggled);
+            toggled &= toggled - 1;
+
+            // The first bit read is the MSB, register 4w is the highest byte
+            uint32_t input = (w * 4 + 3 - bit / 8) * 8 + bit % 8;
+            if (input < inputCount) {
+                _push_shift_register_event(scanner, input, (scanner->state[w] >> bit) & 1, scanTime);
+            }
+        }
+    }
+
+    scanner->primed = true;
+}
+
+void __time_critical_func(_shift_register_scanner_irq_handler)() {
+    for (uint channel = 0; channel < NUM_DMA_CHANNELS; channel++) {
+        ShiftRegisterScanner *scanner = _scanners[channel];
+        if (scanner == NULL || !dma_channel_get_irq1_status(channel)) {
+            continue;
+        }
+        dma_channel_acknowledge_irq1(channel);
+
+        // Taken here, the timer may already have requested the next scan
+        _debounce_shift_register_scan(scanner, time_us_32());
+        scanner->scanCount++;
+
+        // The RX FIFO holds the next scan until the channel is armed again
+        dma_channel_transfer_to_buffer_now(channel, scanner->samples, scanner->wordCount);
+    }
+}
+
+void _free_shift_register_scanner(ShiftRegisterScanner *scanner) {
+    free(scanner->samples);
+    free(scanner->state);
+    free(scanner->counter0);
+    free(scanner->counter1);
+    scanner->samples = NULL;
+    scanner->state = NULL;
+    scanner->counter0 = NULL;
+    scanner->counter1 = NULL;
+}
+
+// Everything set up by init_shift_register_scanner but the timer
+void _release_shift_register_scanner(ShiftRegisterScanner *scanner) {
+    ShiftRegister *shiftRegister = scanner->shiftRegister;
+    uint channel = shiftRegister->dmaChannel;
+
+    pio_sm_set_enabled(shiftRegister->pio, shiftRegister->sm, false);
+
+    // The IRQ is disabled first, an abort can still raise it
+    dma_channel_set_irq1_enabled(channel, false);
+    _scanners[channel] = NULL;
+    dma_channel_abort(channel);
+    dma_channel_acknowledge_irq1(channel);
+    dma_channel_unclaim(channel);
+
+    _free_shift_register_scanner(scanner);
+}
+
+/**
+ * @brief Scans a 74HC165 chain in the background and queues debounced edges.
+ *
+ * A repeating timer starts a scan every periodUs, the PIO loads and shifts the chain and a DMA
+ * channel moves the words to memory. The DMA IRQ debounces the scan and pushes one event per
+ * changed input to a lock-free queue read with get_shift_register_event.
+ * An edge is reported 4 scans after the input settles.
+ *
+ * Uses shift_register_scan_program.
+ * dataPin <- QH, clockPin -> CLK, updateData -> /PL
+ *
+ * @param[in] scanner Scanner to initialize.
+ * @param[in] shiftRegister Shift register with pio, sm, pins and registerCount configured.
+ * @param[in] offset Offset of shift_register_scan_program.
+ * @param[in] clock Shift clock, same limits as init_in_shift_register.
+ * @param[in] periodUs Time between scans in microseconds.
+ *
+ * @return false if the buffers can't be allocated or no timer is left, nothing stays claimed then.
+ */
+bool init_shift_register_scanner(ShiftRegisterScanner *scanner, ShiftRegister *shiftRegister, uint offset, float clock, uint32_t periodUs) {
+    PIO pio = shiftRegister->pio;
+    uint sm = shiftRegister->sm;
+
+    scanner->shiftRegister = shiftRegister;
+    scanner->wordCount = (shiftRegister->registerCount + 3) / 4;
+    scanner->samples = (uint32_t *) calloc(scanner->wordCount, sizeof(uint32_t));
+    scanner->state = (uint32_t *) calloc(scanner->wordCount, sizeof(uint32_t));
+    scanner->counter0 = (uint32_t *) calloc(scanner->wordCount, sizeof(uint32_t));
+    scanner->counter1 = (uint32_t *) calloc(scanner->wordCount, sizeof(uint32_t));
+    if (scanner->samples == NULL || scanner->state == NULL || scanner->counter0 == NULL || scanner->counter1 == NULL) {
+        _free_shift_register_scanner(scanner);
+        return false;
+    }
+    scanner->primed = false;
+    scanner->scanCount = 0;
+    scanner->eventHead = 0;
+    scanner->eventTail = 0;
+    scanner->droppedEvents = 0;
+
+    clock *= 3;
+    float clockDiv = (float) clock_get_hz(clk_sys) / clock;
+    pio_sm_config c = shift_register_scan_program_get_default_config(offset);
+
+    pio_gpio_init(pio, shiftRegister->dataPin);
+    pio_gpio_init(pio, shiftRegister->clockPin);
+    pio_gpio_init(pio, shiftRegister->updateData);
+
+    sm_config_set_in_pins(&c, shiftRegister->dataPin);
+    pio_sm_set_consecutive_pindirs(pio, sm, shiftRegister->dataPin, 1, false);
+    sm_config_set_sideset_pins(&c, shiftRegister->clockPin);
+    pio_sm_set_consecutive_pindirs(pio, sm, shiftRegister->clockPin, 1, true);
+    sm_config_set_set_pins(&c, shiftRegister->updateData, 1);
+    pio_sm_set_consecutive_pindirs(pio, sm, shiftRegister->updateData, 1, true);
+    pio_sm_set_pins_with_mask(pio, sm, 1u << shiftRegister->updateData, 1u << shiftRegister->updateData);
+
+    shiftRegister->fifoBits = 32;
+    sm_config_set_in_shift(&c, false, true, 32);
+    sm_config_set_out_shift(&c, true, false, 32);
+
+    sm_config_set_clkdiv(&c, clockDiv);
+    pio_sm_init(pio, sm, offset, &c);
+
+    shiftRegister->dmaChannel = dma_claim_unused_channel(true);
+    dma_channel_config dmaConfig = dma_channel_get_default_config(shiftRegister->dmaChannel);
+    channel_config_set_transfer_data_size(&dmaConfig, DMA_SIZE_32);
+    channel_config_set_read_increment(&dmaConfig, false);
+    channel_config_set_write_increment(&dmaConfig, true);
+    channel_config_set_dreq(&dmaConfig, pio_get_dreq(pio, sm, false));
+    dma_channel_configure(shiftRegister->dmaChannel, &dmaConfig, scanner->samples, &pio->rxf[sm], scanner->wordCount, true);
+
+    _scanners[shiftRegister->dmaChannel] = scanner;
+    dma_channel_set_irq1_enabled(shiftRegister->dmaChannel, true);
+    if (!_scanner_irq_installed) {
+        irq_add_shared_handler(DMA_IRQ_1, _shift_register_scanner_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+        irq_set_enabled(DMA_IRQ_1, true);
+        _scanner_irq_installed = true;
+    }
+
+    pio_sm_set_enabled(pio, sm, true);
+
+    // Negative delay keeps a fixed rate regardless of the callback's run time
+    if (!add_repeating_timer_us(-(int64_t) periodUs, _shift_register_scanner_timer_callback, scanner, &scanner->timer)) {
+        _release_shift_register_scanner(scanner);
+        return false;
+    }
+    return true;
+}
+
+// Stops scanning, unclaims the DMA channel and frees the buffers. The state machine stays claimed,
+// queued events can't be read anymore.
+void deinit_shift_register_scanner(ShiftRegisterScanner *scanner) {
+    cancel_repeating_timer(&scanner->timer);
+    _release_shift_register_scanner(scanner);
+}
+
+/**
+ * @brief Pops the oldest debounced edge.
+ *
+ * Only one consumer may call this at a time.
+ *
+ * @param[in] scanner Scanner to read from.
+ * @param[out] event Oldest event, input uses the same numbering as the debounced state,
+ * input n is bit n % 8 of register n / 8.
+ *
+ * @return false if the queue is empty.
+ */
+bool get_shift_register_event(ShiftRegisterScanner *scanner, ShiftRegisterEvent *event) {
+    uint32_t tail = scanner->eventTail;
+    if (tail == scanner->eventHead) {
+        return false;
+    }
+
+    __dmb();
+    *event = scanner->events[tail % SHIFT_REGISTER_EVENT_QUEUE_SIZE];
+    __dmb();
+    scanner->eventTail = tail + 1;
+    return true;
+}
+
+// Debounced state of one input, input n is bit n % 8 of register n / 8
+bool get_shift_register_input(ShiftRegisterScanner *scanner, uint32_t input) {
+    uint32_t w = input / 32;
+    uint8_t bit = (3 - (input / 8) % 4) * 8 + input % 8;
+    return (scanner->state[w] >> bit) & 1;
+}
+
+/**
+ * @brief Initializes a shadow image of an output chain.
+ *
+ * Outputs are changed in the shadow image and only sent by flush_shift_register_shadow, which skips
+ * the transmission when the image did not change since the last one.
+ * Output n is bit n % 8 of register n / 8, with the same register order as write_to_shift_register.
+ *
+ * @param[in] shadow Shadow to initialize, every output starts low.
+ * @param[in] shiftRegister Output shift register already initialized with init_out_shift_register(_words).
+ * @param[in] minIntervalUs Minimum time between transmissions, changes made in between are coalesced
+ * into the next flush. Pass 0 to send on every flush.
+ *
+ * @return false if the images can't be allocated.
+ */
+bool init_shift_register_shadow(ShiftRegisterShadow *shadow, ShiftRegister *shiftRegister, uint32_t minIntervalUs) {
+    shadow->shiftRegister = shiftRegister;
+    shadow->image = (uint8_t *) calloc(shiftRegister->registerCount, sizeof(uint8_t));
+    shadow->sent = (uint8_t *) calloc(shiftRegister->registerCount, sizeof(uint8_t));
+    if (shadow->image == NULL || shadow->sent == NULL) {
+        free(shadow->image);
+        free(shadow->sent);
+        shadow->image = NULL;
+        shadow->sent = NULL;
+        return false;
+    }
+    shadow->dirty = true;
+    shadow->minIntervalUs = minIntervalUs;
+    shadow->lastFlush = time_us_32() - minIntervalUs;
+    shadow->flushCount = 0;
+    shadow->skippedCount = 0;
+    return true;
+}
+
+void set_shift_register_output(ShiftRegisterShadow *shadow, uint16_t output) {
+    shadow->image[output / 8] |= 1u << (output % 8);
+    shadow->dirty = true;
+}
+
+void clear_shift_register_output(ShiftRegisterShadow *shadow, uint16_t output) {
+    shadow->image[output / 8] &= ~(1u << (output % 8));
+    shadow->dirty = true;
+}
+
+void toggle_shift_register_output(ShiftRegisterShadow *shadow, uint16_t output) {
+    shadow->image[output / 8] ^= 1u << (output % 8);
+    shadow->dirty = true;
+}
+
+bool get_shift_register_output(ShiftRegisterShadow *shadow, uint16_t output) {
+    return (shadow->image[output / 8] >> (output % 8)) & 1;
+}
+
+/**
+ * @brief Changes up to 32 consecutive outputs at once.
+ *
+ * @param[in] shadow Shadow to change.
+ * @param[in] firstOutput Output matching bit 0 of mask and value.
+ * @param[in] mask Outputs to change, bit n is firstOutput + n.
+ * @param[in] value New state of the masked outputs.
+ */
+void update_shift_register_outputs(ShiftRegisterShadow *shadow, uint16_t firstOutput, uint32_t mask, uint32_t value) {
+    while (mask) {
+        uint8_t bit = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        uint16_t output = firstOutput + bit;
+        if ((value >> bit) & 1) {
+            shadow->image[output / 8] |= 1u << (output % 8);
+        } else {
+            shadow->image[output / 8] &= ~(1u << (output % 8));
+        }
+    }
+    shadow->dirty = true;
+}
+
+/**
+ * @brief Sends the shadow image if it differs from the last image sent.
+ *
+ * @param[in] shadow Shadow to send.
+ *
+ * @return true if the chain was updated, false if nothing changed or minIntervalUs did not
+ * elapse yet, in which case the changes are kept for the next flush.
+ */
+bool flush_shift_register_shadow(ShiftRegisterShadow *shadow) {
+    if (!shadow->dirty) {
+        return false;
+    }
+
+    uint16_t registerCount = shadow->shiftRegister->registerCount;
+    if (memcmp(shadow->image, shadow->sent, registerCount) == 0 && shadow->flushCount != 0) {
+        shadow->dirty = false;
+        return false;
+    }
+
+    uint32_t now = time_us_32();
+    if (now - shadow->lastFlush < shadow->minIntervalUs) {
+        shadow->skippedCount++;
+        return false;
+    }
+
+    memcpy(shadow->sent, shadow->image, registerCount);
+    write_to_shift_register(shadow->shiftRegister, shadow->sent);
+
+    shadow->dirty = false;
+    shadow->lastFlush = now;
+    shadow->flushCount++;
+    return true;
 }
 
 void print_bits(uint32_t data, uint8_t dataSize) {
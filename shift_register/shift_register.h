@@ -4,21 +4,136 @@
 #include <stdio.h>
 #include "pico/stdlib.h"
 #include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
 #include "shift_register.pio.h"
 
+typedef struct ShiftRegister ShiftRegister;
+typedef void (*ShiftRegisterCallback)(ShiftRegister *shiftRegister);
+
 typedef struct ShiftRegister {
     PIO pio;
     uint sm;
-    uint8_t registerCount;
+    uint16_t registerCount;
     uint8_t dataPin;
     uint8_t clockPin;
     uint8_t updateData;
+    uint8_t fifoBits;  // Set by the init functions, 8 or 32
+
+    // Only used by the duplex functions
+    uint16_t inputRegisterCount;
+    uint8_t inputPin;
+    uint8_t loadPin;
+
+    // Only used by the DMA functions
+    int dmaChannel;
+    volatile bool busy;
+    ShiftRegisterCallback callback;
+    uint32_t *dmaBuffer;  // Data in shifting order, sized for registerCount at init
+
+    // Only used by the parallel functions
+    uint8_t chainCount;
 } ShiftRegister;
 
+typedef struct ShiftRegisterDisplay {
+    ShiftRegister *shiftRegister;
+    uint8_t brightnessBits;
+    uint8_t *framebuffer;  // One brightness value per output, write here and call swap_shift_register_display
+
+    // Bit plane frames, one is displayed while the other is written
+    uint32_t *frames[2];
+    uint32_t frameWords;
+    uint16_t wordCount;
+    uint8_t backFrame;
+    uint32_t *volatile nextFrame;
+    volatile bool swapPending;
+    int controlChannel;
+
+    // Statistics
+    volatile uint32_t frameCount;
+    volatile uint32_t irqCycles;  // Processor cycles spent in the frame IRQ
+    uint32_t lastStatsTime;
+    uint32_t lastFrameCount;
+    uint32_t lastIrqCycles;
+} ShiftRegisterDisplay;
+
+// Must be a power of 2
+#ifndef SHIFT_REGISTER_EVENT_QUEUE_SIZE
+#define SHIFT_REGISTER_EVENT_QUEUE_SIZE 64
+#endif
+
+typedef struct ShiftRegisterEvent {
+    uint32_t timestamp;  // time_us_32() when the scan that confirmed the edge completed
+    uint32_t input;
+    bool rising;
+} ShiftRegisterEvent;
+
+typedef struct ShiftRegisterScanner {
+    ShiftRegister *shiftRegister;
+    uint16_t wordCount;
+    uint32_t *samples;
+
+    // Debounced state and vertical counters, one bit per input
+    uint32_t *state;
+    uint32_t *counter0;
+    uint32_t *counter1;
+    bool primed;
+
+    repeating_timer_t timer;
+    volatile uint32_t scanCount;
+
+    // Single producer (DMA IRQ), single consumer queue
+    ShiftRegisterEvent events[SHIFT_REGISTER_EVENT_QUEUE_SIZE];
+    volatile uint32_t eventHead;
+    volatile uint32_t eventTail;
+    volatile uint32_t droppedEvents;
+} ShiftRegisterScanner;
+
+typedef struct ShiftRegisterShadow {
+    ShiftRegister *shiftRegister;
+    uint8_t *image;  // Pending state, one bit per output
+    uint8_t *sent;  // Last state sent to the chain
+    bool dirty;
+    uint32_t minIntervalUs;
+    uint32_t lastFlush;
+
+    // Statistics
+    uint32_t flushCount;
+    uint32_t skippedCount;
+} ShiftRegisterShadow;
+
 void init_out_shift_register(ShiftRegister *shiftRegister, uint offset, float clock);
 void init_in_shift_register(ShiftRegister *shiftRegister, uint offset, float clock);
+void init_out_shift_register_words(ShiftRegister *shiftRegister, uint offset, float clock);
+void init_in_shift_register_words(ShiftRegister *shiftRegister, uint offset, float clock);
+void init_duplex_shift_register(ShiftRegister *shiftRegister, uint offset, float clock);
+void init_duplex_shift_register_words(ShiftRegister *shiftRegister, uint offset, float clock);
+void transfer_shift_register(ShiftRegister *shiftRegister, uint8_t *outData, uint8_t inData[]);
 void write_to_shift_register(ShiftRegister *shiftRegister, uint8_t *dataArray);
 void read_from_shift_register(ShiftRegister *shiftRegister, uint8_t dataArray[]);
+bool init_out_shift_register_dma(ShiftRegister *shiftRegister, uint offset, float clock, ShiftRegisterCallback callback);
+bool init_out_shift_register_dma_words(ShiftRegister *shiftRegister, uint offset, float clock, ShiftRegisterCallback callback);
+void deinit_shift_register_dma(ShiftRegister *shiftRegister);
+void write_to_shift_register_dma(ShiftRegister *shiftRegister, const uint8_t *dataArray);
+bool init_parallel_shift_register(ShiftRegister *shiftRegister, uint offset, float clock, ShiftRegisterCallback callback);
+void write_to_parallel_shift_register(ShiftRegister *shiftRegister, uint8_t *chains[]);
+bool shift_register_dma_busy(ShiftRegister *shiftRegister);
+void wait_for_shift_register_dma(ShiftRegister *shiftRegister);
+bool init_shift_register_display(ShiftRegisterDisplay *display, ShiftRegister *shiftRegister, uint offset, float clock, uint8_t brightnessBits, float refreshRate);
+void swap_shift_register_display(ShiftRegisterDisplay *display);
+void get_shift_register_display_stats(ShiftRegisterDisplay *display, float *refreshRate, float *cpuLoad);
+bool init_shift_register_scanner(ShiftRegisterScanner *scanner, ShiftRegister *shiftRegister, uint offset, float clock, uint32_t periodUs);
+void deinit_shift_register_scanner(ShiftRegisterScanner *scanner);
+bool get_shift_register_event(ShiftRegisterScanner *scanner, ShiftRegisterEvent *event);
+bool get_shift_register_input(ShiftRegisterScanner *scanner, uint32_t input);
+bool init_shift_register_shadow(ShiftRegisterShadow *shadow, ShiftRegister *shiftRegister, uint32_t minIntervalUs);
+void set_shift_register_output(ShiftRegisterShadow *shadow, uint16_t output);
+void clear_shift_register_output(ShiftRegisterShadow *shadow, uint16_t output);
+void toggle_shift_register_output(ShiftRegisterShadow *shadow, uint16_t output);
+bool get_shift_register_output(ShiftRegisterShadow *shadow, uint16_t output);
+void update_shift_register_outputs(ShiftRegisterShadow *shadow, uint16_t firstOutput, uint32_t mask, uint32_t value);
+bool flush_shift_register_shadow(ShiftRegisterShadow *shadow);
 void shift_register_example();
 
 #endif
@@ -0,0 +1,43 @@
+#include "stream_usb.h"
+
+// Stand-in for the USB CDC interface when building with PICO_PLATFORM=host.
+// - bytes go to the output file (stdout by default) straight away
+// - the transmit FIFO empties at the configured rate, so a stream that is too fast for the
+//   link drops records like it would on the board
+
+#define STREAM_HOST_FIFO_SIZE 256
+
+FILE *_streamHostOutput = NULL;
+uint32_t _streamHostRate = 1000000;
+uint32_t _streamHostLevel = 0;
+uint32_t _streamHostLastTime = 0;
+
+void stream_host_set_output(FILE *file) {
+    _streamHostOutput = file;
+}
+
+void stream_host_set_rate(uint32_t bytesPerSecond) {
+    _streamHostRate = bytesPerSecond;
+}
+
+void _stream_host_drain() {
+    uint32_t now = time_us_32();
+    uint64_t drained = (uint64_t) (now - _streamHostLastTime) * _streamHostRate / 1000000;
+    if (drained == 0) {
+        return;
+    }
+    _streamHostLevel = drained >= _streamHostLevel ? 0 : _streamHostLevel - drained;
+    _streamHostLastTime = now;
+}
+
+uint32_t stream_usb_available() {
+    _stream_host_drain();
+    return STREAM_HOST_FIFO_SIZE - _streamHostLevel;
+}
+
+void stream_usb_write(const uint8_t *data, uint32_t length) {
+    FILE *output = _streamHostOutput ? _streamHostOutput : stdout;
+    fwrite(data, 1, length, output);
+    fflush(output);
+    _streamHostLevel += length;
+}
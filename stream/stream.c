@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stream.h"
+#include "stream_usb.h"
+#include "744051.h"
+#include "AHT21.h"
+
+// CRC-16/CCITT, polynomial 0x1021, initial value 0xFFFF, 4 bits at a time to keep the table small
+const uint16_t _streamCrcTable[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+};
+
+uint16_t _stream_crc16(const uint8_t *data, uint32_t length) {
+    uint16_t crc = 0xFFFF;
+    for (uint32_t i = 0; i < length; i++) {
+        crc = (crc << 4) ^ _streamCrcTable[(crc >> 12) ^ (data[i] >> 4)];
+        crc = (crc << 4) ^ _streamCrcTable[(crc >> 12) ^ (data[i] & 0x0F)];
+    }
+    return crc;
+}
+
+// Ring bytes are not aligned, values are stored a byte at a time
+void _stream_put_u16(uint8_t *dst, uint16_t value) {
+    dst[0] = value;
+    dst[1] = value >> 8;
+}
+
+void _stream_put_u32(uint8_t *dst, uint32_t value) {
+    dst[0] = value;
+    dst[1] = value >> 8;
+    dst[2] = value >> 16;
+    dst[3] = value >> 24;
+}
+
+/**
+ * @brief Initializes the stream and allocates its transmit ring.
+ *
+ * @param stream Stream to initialize.
+ * @param capacity Size of the transmit ring in bytes, at least 2 * STREAM_FRAME_SPACE.
+ * @param maxLatencyUs Longest time a record waits in an open frame or a partial packet.
+ *
+ * @return false if the transmit ring can't be allocated.
+ */
+bool init_stream(Stream *stream, uint32_t capacity, uint32_t maxLatencyUs) {
+    memset(stream, 0, sizeof(Stream));
+    stream->capacity = MAX(capacity, 2 * STREAM_FRAME_SPACE);
+    stream->buffer = malloc(stream->capacity);
+    if (stream->buffer == NULL) {
+        return false;
+    }
+    stream->end = stream->capacity;
+    stream->maxLatencyUs = maxLatencyUs;
+    stream->lastStatsTime = time_us_32();
+    return true;
+}
+
+bool _stream_open_frame(Stream *stream) {
+    // A frame must be contiguous, wrap to the start when it doesn't fit before the end
+    uint32_t start = stream->head;
+    if (stream->head >= stream->tail) {
+        if (stream->capacity - stream->head < STREAM_FRAME_SPACE) {
+            // Strictly greater, head must never catch up with tail
+            if (stream->tail <= STREAM_FRAME_SPACE) {
+                return false;
+            }
+            stream->end = stream->head;
+            start = 0;
+        }
+    } else if (stream->tail - stream->head <= STREAM_FRAME_SPACE) {
+        return false;
+    }
+
+    stream->frameStart = start;
+    _stream_put_u16(&stream->buffer[start + 1], stream->sequence++);
+    stream->frameLength = 2;
+    stream->frameOpen = true;
+    stream->frameOpenTime = time_us_32();
+    return true;
+}
+
+void _stream_close_frame(Stream *stream) {
+    uint8_t *frame = &stream->buffer[stream->frameStart];
+    uint16_t crc = _stream_crc16(&frame[1], stream->frameLength);
+    _stream_put_u16(&frame[1 + stream->frameLength], crc);
+    uint16_t length = stream->frameLength + 3;
+
+    // COBS in place, every 0x00 becomes the distance to the next one, the first goes in the code byte.
+    // Frames are shorter than 254 bytes so a distance always fits and no code byte has to be inserted
+    uint16_t code = 0;
+    for (uint16_t i = 1; i < length; i++) {
+        if (frame[i] == 0) {
+            frame[code] = i - code;
+            code = i;
+        }
+    }
+    frame[code] = length - code;
+    frame[length] = 0;
+
+    stream->head = stream->frameStart + length + 1;
+    stream->frameOpen = false;
+    stream->framesSent++;
+}
+
+/**
+ * @brief Reserves space for one record in the current frame, the caller writes the payload there.
+ *
+ * The record is part of the stream as soon as this returns, the payload must be written before the
+ * next stream call.
+ *
+ * @param stream Stream to write to.
+ * @param type Record type.
+ * @param length Payload length, at most STREAM_MAX_PAYLOAD.
+ * @return Where the payload goes, NULL if the ring is full and the record was dropped.
+ */
+uint8_t *stream_reserve(Stream *stream, StreamRecordType type, uint8_t length) {
+    if (length > STREAM_MAX_PAYLOAD) {
+        stream->droppedRecords++;
+        return NULL;
+    }
+    if (stream->frameOpen && stream->frameLength + 2 + length + 2 > STREAM_FRAME_SIZE) {
+        _stream_close_frame(stream);
+    }
+    if (!stream->frameOpen && !_stream_open_frame(stream)) {
+        stream->droppedRecords++;
+        return NULL;
+    }
+
+    uint8_t *record = &stream->buffer[stream->frameStart + 1 + stream->frameLength];
+    record[0] = type;
+    record[1] = length;
+    stream->frameLength += 2 + length;
+    stream->recordsWritten++;
+    return &record[2];
+}
+
+bool stream_text(Stream *stream, const char *text) {
+    uint8_t length = MIN(strlen(text), STREAM_MAX_PAYLOAD);
+    uint8_t *payload = stream_reserve(stream, STREAM_RECORD_TEXT, length);
+    if (payload == NULL) {
+        return false;
+    }
+    memcpy(payload, text, length);
+    return true;
+}
+
+/**
+ * @brief Writes one scan of ADC readings, as returned by read_744051_masked/read_multiple_744051.
+ *
+ * @param stream Stream to write to.
+ * @param timestamp time_us_32() of the scan.
+ * @param firstChannel Channel of the first sample, lets a scan be split over several records.
+ * @param samples Raw 12 bit readings.
+ * @param count Number of samples, at most (STREAM_MAX_PAYLOAD - 5) / 2.
+ */
+bool stream_adc_frame(Stream *stream, uint32_t timestamp, uint8_t firstChannel, const uint16_t *samples, uint8_t count) {
+    if (count > (STREAM_MAX_PAYLOAD - 5) / 2) {
+        stream->droppedRecords++;
+        return false;
+    }
+    uint8_t *payload = stream_reserve(stream, STREAM_RECORD_ADC_FRAME, 5 + 2 * count);
+    if (payload == NULL) {
+        return false;
+    }
+    _stream_put_u32(payload, timestamp);
+    payload[4] = firstChannel;
+    for (uint8_t i = 0; i < count; i++) {
+        _stream_put_u16(&payload[5 + 2 * i], samples[i]);
+    }
+    return true;
+}
+
+bool stream_input_event(Stream *stream, uint32_t timestamp, uint16_t input, bool rising) {
+    uint8_t *payload = stream_reserve(stream, STREAM_RECORD_INPUT_EVENT, 7);
+    if (payload == NULL) {
+        return false;
+    }
+    _stream_put_u32(payload, timestamp);
+    _stream_put_u16(&payload[4], input);
+    payload[6] = rising;
+    return true;
+}
+
+// Humidity (0 to 10000) and temperature (-5000 to 15000) fit in 16 bits
+bool stream_sensor_reading(Stream *stream, uint32_t timestamp, uint8_t sensor, int32_t humidityCenti, int32_t temperatureCenti) {
+    uint8_t *payload = stream_reserve(stream, STREAM_RECORD_SENSOR_READING, 9);
+    if (payload == NULL) {
+        return false;
+    }
+    _stream_put_u32(payload, timestamp);
+    payload[4] = sensor;
+    _stream_put_u16(&payload[5], (int16_t) humidityCenti);
+    _stream_put_u16(&payload[7], (int16_t) temperatureCenti);
+    return true;
+}
+
+// Closes the open frame and sends everything on the next stream_task calls, partial packets included
+void stream_flush(Stream *stream) {
+    if (stream->frameOpen) {
+        _stream_close_frame(stream);
+    }
+    stream->flushRequested = true;
+}
+
+/**
+ * @brief Sends what USB can take without blocking, call it from the main loop.
+ *
+ * @param stream Stream to send.
+ * @return True if anything was handed to USB.
+ */
+bool stream_task(Stream *stream) {
+    uint32_t now = time_us_32();
+    if (stream->frameOpen && now - stream->frameOpenTime >= stream->maxLatencyUs) {
+        stream_flush(stream);
+    } else if (stream->tail != stream->head && now - stream->lastSendTime >= stream->maxLatencyUs) {
+        // Less than a packet has been waiting
+        stream->flushRequested = true;
+    }
+
+    // Data up to the head, or up to the end and then from the start once head wrapped
+    bool wrapped = stream->head < stream->tail;
+    uint32_t first = (wrapped ? stream->end : stream->head) - stream->tail;
+    uint32_t ready = first + (wrapped ? stream->head : 0);
+    uint32_t available = stream_usb_available();
+    uint32_t length = MIN(ready, available);
+    if (!stream->flushRequested) {
+        // Full packets only, unless the data waiting has become too old
+        length -= length % STREAM_PACKET_SIZE;
+    }
+
+    bool sent = length > 0;
+    if (length > first) {
+        if (first > 0) {
+            stream_usb_write(&stream->buffer[stream->tail], first);
+        }
+        stream_usb_write(stream->buffer, length - first);
+        stream->tail = length - first;
+    } else if (length > 0) {
+        stream_usb_write(&stream->buffer[stream->tail], length);
+        stream->tail += length;
+        if (wrapped && stream->tail == stream->end) {
+            stream->tail = 0;
+        }
+    }
+    stream->bytesSent += length;
+
+    if (sent || stream->tail == stream->head) {
+        stream->lastSendTime = now;
+    }
+    if (stream->tail == stream->head) {
+        stream->flushRequested = false;
+    }
+    return sent;
+}
+
+// Averages since the previous call
+void get_stream_stats(Stream *stream, float *bytesPerSecond, float *recordsPerSecond) {
+    uint32_t now = time_us_32();
+    float elapsed = (now - stream->lastStatsTime) / 1000000.0f;
+
+    *bytesPerSecond = (stream->bytesSent - stream->lastBytesSent) / elapsed;
+    *recordsPerSecond = (stream->recordsWritten - stream->lastRecordsWritten) / elapsed;
+
+    stream->lastStatsTime = now;
+    stream->lastBytesSent = stream->bytesSent;
+    stream->lastRecordsWritten = stream->recordsWritten;
+}
+
+// Called from AHT21_pollFleet in the example loop, so the stream is only written from the main loop
+void _stream_example_aht21_callback(AHT21 *aht21, void *userData) {
+    Stream *stream = (Stream *) userData;
+    if (aht21->measurement.status == AHT21_OK) {
+        stream_sensor_reading(stream, aht21->measurement.timestamp, 0, aht21->measurement.humidityCenti, aht21->measurement.temperatureCenti);
+    }
+}
+
+// Streams 24 analog inputs at 1kHz and the AHT21 as fast as it measures, decode with
+// python3 tools/stream_decode.py /dev/ttyACM0
+void stream_example() {
+    Stream stream;
+    if (!init_stream(&stream, 8192, 20000)) {
+        printf("Not enough memory for the stream\n");
+        return;
+    }
+
+    // 24 analog inputs
+    init_744051_adc();
+    C744051 c744051[3];
+    init_744051(&c744051[0], 26, 13, 10, 11, 12);
+    init_744051(&c744051[1], 26, 14, 10, 11, 12);
+    init_744051(&c744051[2], 28, NO_DISABLE_PIN, 10, 11, 12);
+
+    // Humidity and temperature
+    i2c_init(i2c0, 400000);
+    gpio_set_function(4, GPIO_FUNC_I2C);
+    gpio_set_function(5, GPIO_FUNC_I2C);
+    gpio_pull_up(4);
+    gpio_pull_up(5);
+    sleep_ms(100);
+    AHT21 aht21;
+    AHT21_init(&aht21, i2c0, AHT21_ADDRESS, AHT21_NO_SWITCH, 0);
+    AHT21 *sensors[1] = {&aht21};
+    AHT21Fleet fleet;
+    if (!AHT21_startFleetPolled(&fleet, sensors, 1, 0, _stream_example_aht21_callback, &stream)) {
+        printf("Not enough memory for the AHT21 fleet\n");
+        return;
+    }
+
+    uint32_t lastScan = time_us_32();
+    uint32_t lastReport = time_us_32();
+    while (true) {
+        AHT21_pollFleet(&fleet);
+
+        if (time_us_32() - lastScan >= 1000) {
+            lastScan += 1000;
+
+            uint16_t data[24];
+            read_multiple_744051(c744051, 3, 1, data, false);
+            stream_adc_frame(&stream, time_us_32(), 0, data, 24);
+        }
+
+        stream_task(&stream);
+
+        if (time_us_32() - lastReport >= 5000000) {
+            lastReport += 5000000;
+
+            float bytesPerSecond;
+            float recordsPerSecond;
+            get_stream_stats(&stream, &bytesPerSecond, &recordsPerSecond);
+            char text[96];
+            snprintf(text, sizeof(text), "%.0f bytes/s, %.0f records/s, %u dropped", bytesPerSecond, recordsPerSecond, stream.droppedRecords);
+            stream_text(&stream, text);
+        }
+    }
+}
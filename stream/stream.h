@@ -0,0 +1,87 @@
+/**
+ * @brief Binary record stream over USB CDC, replaces printf output of measurements.
+ *
+ * *** Records ***
+ * - A record is a type byte, a length byte and a little endian payload: ADC frames, input events,
+ *   sensor readings or text. The payload is written straight into the transmit ring,
+ *   stream_reserve() returns where it goes, no copy is made.
+ * - Records are batched into frames of up to STREAM_FRAME_SIZE bytes: a 16 bit sequence number,
+ *   the records and a CRC-16/CCITT of both. The host spots lost frames with the sequence number.
+ *
+ * *** Framing ***
+ * - Frames are COBS encoded and end with a 0x00 byte, the host resyncs on the next 0x00 after an
+ *   error or when it connects midway.
+ * - Frames never hold more than 253 bytes, so the encoding is one byte longer and is done in place
+ *   in the ring once the frame is closed.
+ * - A frame is closed when the next record doesn't fit or when it has been open for maxLatencyUs.
+ *
+ * *** Transmit ***
+ * - stream_task() hands the ring to USB in multiples of STREAM_PACKET_SIZE so every bulk packet is
+ *   full, a partial packet is only sent once the data is maxLatencyUs old.
+ * - When the ring is full records are dropped and counted, nothing blocks.
+ * - All calls must come from the same core and not from interrupts. With the runtime, push data
+ *   from core1 through a RuntimeQueue and write the stream from a core0 task.
+ * - stream_usb_pico.c writes to the stdio USB CDC interface, host/stream_usb_host.c emulates it so
+ *   the stream can run on PICO_PLATFORM=host. Decode with tools/stream_decode.py.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "pico/stdlib.h"
+
+// Raw frame: sequence number, records and CRC, at most 254 bytes COBS encoded
+#define STREAM_FRAME_SIZE 253
+#define STREAM_FRAME_SPACE (STREAM_FRAME_SIZE + 2)  // Encoded frame and delimiter
+#define STREAM_MAX_PAYLOAD (STREAM_FRAME_SIZE - 6)
+
+// USB full speed bulk packet
+#define STREAM_PACKET_SIZE 64
+
+typedef enum StreamRecordType {
+    STREAM_RECORD_TEXT = 1,  // ASCII, no terminator
+    STREAM_RECORD_ADC_FRAME = 2,  // u32 timestamp, u8 first channel, u16 samples[]
+    STREAM_RECORD_INPUT_EVENT = 3,  // u32 timestamp, u16 input, u8 rising
+    STREAM_RECORD_SENSOR_READING = 4,  // u32 timestamp, u8 sensor, s16 centi-percent, s16 centi-degrees
+} StreamRecordType;
+
+typedef struct Stream {
+    // Transmit ring, data between tail and head is encoded and ready to send
+    uint8_t *buffer;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t end;  // Where the data stops once head wrapped back to the start
+
+    // Frame being filled
+    bool frameOpen;
+    uint32_t frameStart;  // Index of the COBS code byte
+    uint16_t frameLength;  // Raw bytes after the code byte, sequence number included
+    uint16_t sequence;
+    uint32_t frameOpenTime;
+    uint32_t maxLatencyUs;
+    bool flushRequested;
+    uint32_t lastSendTime;
+
+    // Statistics
+    uint32_t recordsWritten;
+    uint32_t droppedRecords;
+    uint32_t framesSent;
+    uint32_t bytesSent;
+    uint32_t lastStatsTime;
+    uint32_t lastRecordsWritten;
+    uint32_t lastBytesSent;
+} Stream;
+
+bool init_stream(Stream *stream, uint32_t capacity, uint32_t maxLatencyUs);
+uint8_t *stream_reserve(Stream *stream, StreamRecordType type, uint8_t length);
+bool stream_text(Stream *stream, const char *text);
+bool stream_adc_frame(Stream *stream, uint32_t timestamp, uint8_t firstChannel, const uint16_t *samples, uint8_t count);
+bool stream_input_event(Stream *stream, uint32_t timestamp, uint16_t input, bool rising);
+bool stream_sensor_reading(Stream *stream, uint32_t timestamp, uint8_t sensor, int32_t humidityCenti, int32_t temperatureCenti);
+void stream_flush(Stream *stream);
+bool stream_task(Stream *stream);
+void get_stream_stats(Stream *stream, float *bytesPerSecond, float *recordsPerSecond);
+void stream_example();
+
+#endif
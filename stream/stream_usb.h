@@ -0,0 +1,22 @@
+#ifndef STREAM_USB_H
+#define STREAM_USB_H
+
+#include "pico/stdlib.h"
+
+// USB CDC used by the stream.
+// stream_usb_pico.c writes to the stdio USB interface, host/stream_usb_host.c emulates a CDC
+// interface draining at a fixed rate so the stream can run on PICO_PLATFORM=host.
+#if !PICO_ON_DEVICE
+#include <stdio.h>
+
+void stream_host_set_output(FILE *file);
+void stream_host_set_rate(uint32_t bytesPerSecond);
+#endif
+
+// Bytes that can be written without blocking, 0 when no host is connected
+uint32_t stream_usb_available();
+
+// Queues length bytes, at most stream_usb_available(), and starts sending them
+void stream_usb_write(const uint8_t *data, uint32_t length);
+
+#endif
@@ -0,0 +1,16 @@
+#include "stream_usb.h"
+#include "pico/stdio_usb.h"
+#include "pico/stdio/driver.h"
+#include "tusb.h"
+
+uint32_t stream_usb_available() {
+    if (!stdio_usb_connected()) {
+        return 0;
+    }
+    return tud_cdc_write_available();
+}
+
+// Goes through the stdio driver, it holds the lock the USB background task uses
+void stream_usb_write(const uint8_t *data, uint32_t length) {
+    stdio_usb.out_chars((const char *) data, length);
+}
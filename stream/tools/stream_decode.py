@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+"""Decodes the binary record stream sent by the stream library.
+
+Frames are COBS encoded and end with 0x00, each holds a sequence number, records and a CRC-16/CCITT.
+Corrupt frames are skipped and lost frames are counted from the sequence numbers.
+
+    python3 stream_decode.py /dev/ttyACM0
+    python3 stream_decode.py /dev/ttyACM0 --seconds 10 --stats
+    python3 stream_decode.py capture.bin --csv records.csv
+
+Without --csv the records are printed one per line, --stats only prints the totals.
+"""
+
+import argparse
+import binascii
+import csv
+import struct
+import sys
+import time
+
+RECORD_TEXT = 1
+RECORD_ADC_FRAME = 2
+RECORD_INPUT_EVENT = 3
+RECORD_SENSOR_READING = 4
+
+RECORD_NAMES = {
+    RECORD_TEXT: "text",
+    RECORD_ADC_FRAME: "adc",
+    RECORD_INPUT_EVENT: "input",
+    RECORD_SENSOR_READING: "sensor",
+}
+
+
+def cobs_decode(data):
+    out = bytearray()
+    index = 0
+    while index < len(data):
+        code = data[index]
+        if code == 0 or index + code > len(data):
+            raise ValueError("bad COBS code")
+        out += data[index + 1:index + code]
+        index += code
+        if code < 0xFF and index < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def parse_record(kind, payload):
+    if kind == RECORD_TEXT:
+        return [payload.decode("ascii", "replace")]
+    if kind == RECORD_ADC_FRAME:
+        timestamp, first_channel = struct.unpack_from("<IB", payload)
+        samples = struct.unpack_from("<%dH" % ((len(payload) - 5) // 2), payload, 5)
+        return [timestamp, first_channel] + list(samples)
+    if kind == RECORD_INPUT_EVENT:
+        timestamp, channel, rising = struct.unpack("<IHB", payload)
+        return [timestamp, channel, "rising" if rising else "falling"]
+    if kind == RECORD_SENSOR_READING:
+        timestamp, sensor, humidity, temperature = struct.unpack("<IBhh", payload)
+        return [timestamp, sensor, humidity / 100.0, temperature / 100.0]
+    return [payload.hex()]
+
+
+class Decoder:
+    def __init__(self):
+        self.pending = bytearray()
+        self.sequence = None
+        self.frames = 0
+        self.records = 0
+        self.bytes = 0
+        self.corrupt = 0
+        self.lost = 0
+
+    def feed(self, data):
+        """Returns (type, fields) for every record completed by data."""
+        self.bytes += len(data)
+        self.pending += data
+        records = []
+        while True:
+            end = self.pending.find(0)
+            if end < 0:
+                return records
+            encoded = bytes(self.pending[:end])
+            del self.pending[:end + 1]
+            if encoded:
+                records += self.decode_frame(encoded)
+
+    def decode_frame(self, encoded):
+        try:
+            frame = cobs_decode(encoded)
+        except ValueError:
+            self.corrupt += 1
+            return []
+        if len(frame) < 4 or binascii.crc_hqx(frame[:-2], 0xFFFF) != struct.unpack_from("<H", frame, len(frame) - 2)[0]:
+            self.corrupt += 1
+            return []
+
+        (sequence,) = struct.unpack_from("<H", frame)
+        if self.sequence is not None:
+            self.lost += (sequence - self.sequence - 1) & 0xFFFF
+        self.sequence = sequence
+        self.frames += 1
+
+        records = []
+        index = 2
+        while index + 2 <= len(frame) - 2:
+            kind, length = frame[index], frame[index + 1]
+            payload = frame[index + 2:index + 2 + length]
+            index += 2 + length
+            try:
+                records.append((kind, parse_record(kind, payload)))
+            except struct.error:
+                continue
+        self.records += len(records)
+        return records
+
+
+def read_chunks(path, seconds):
+    if not path.startswith("/dev/") and not path.upper().startswith("COM"):
+        with open(path, "rb") as file:
+            while True:
+                chunk = file.read(65536)
+                if not chunk:
+                    return
+                yield chunk
+
+    import serial  # pyserial, only needed to capture straight from the board
+
+    with serial.Serial(path, timeout=0.1) as port:
+        deadline = time.time() + seconds
+        while time.time() < deadline:
+            yield port.read(4096)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="capture file or serial port")
+    parser.add_argument("--seconds", type=float, default=float("inf"), help="time to capture from a serial port")
+    parser.add_argument("--csv", help="write the records to a CSV file, type first")
+    parser.add_argument("--stats", action="store_true", help="only print the totals")
+    args = parser.parse_args()
+
+    decoder = Decoder()
+    csv_file = open(args.csv, "w", newline="") if args.csv else None
+    writer = csv.writer(csv_file) if csv_file else None
+    start = time.time()
+    try:
+        for chunk in read_chunks(args.input, args.seconds):
+            for kind, fields in decoder.feed(chunk):
+                name = RECORD_NAMES.get(kind, str(kind))
+                if writer:
+                    writer.writerow([name] + fields)
+                elif not args.stats:
+                    print(name, *fields)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if csv_file:
+            csv_file.close()
+
+    elapsed = time.time() - start
+    print("%d bytes, %d frames, %d records, %d corrupt, %d lost in %.1fs (%.0f bytes/s)" % (
+        decoder.bytes, decoder.frames, decoder.records, decoder.corrupt, decoder.lost, elapsed,
+        decoder.bytes / elapsed if elapsed > 0 else 0), file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
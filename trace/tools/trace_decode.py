@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+"""Decodes the binary dumps sent by trace_dump().
+
+The dump can be mixed with normal printf output, every dump found in the input is decoded.
+
+    python3 trace_decode.py capture.bin
+    python3 trace_decode.py /dev/ttyACM0 --seconds 10
+    python3 trace_decode.py capture.bin --chrome trace.json
+
+--chrome writes the events in the Chrome trace format, open it in chrome://tracing or ui.perfetto.dev.
+"""
+
+import argparse
+import json
+import struct
+import sys
+import time
+
+MAGIC = b"TRC1"
+END = b"END1"
+VERSION = 1
+
+
+class Reader:
+    def __init__(self, data, offset):
+        self.data = data
+        self.offset = offset
+
+    def take(self, size):
+        if self.offset + size > len(self.data):
+            raise EOFError
+        chunk = self.data[self.offset:self.offset + size]
+        self.offset += size
+        return chunk
+
+    def unpack(self, fmt):
+        return struct.unpack("<" + fmt, self.take(struct.calcsize("<" + fmt)))
+
+
+def bucket_limit(bucket):
+    """Highest value that falls in the bucket, same as _trace_bucket_limit."""
+    if bucket < 4:
+        return bucket
+    octave = bucket // 4 + 1
+    width = 1 << (octave - 2)
+    return (4 + bucket % 4) * width + width - 1
+
+
+def parse_dump(data, offset):
+    reader = Reader(data, offset + len(MAGIC))
+    version, core_count, probe_count, bucket_count = reader.unpack("BBBB")
+    if version != VERSION:
+        raise ValueError("unsupported dump version %d" % version)
+    (cycles_per_us,) = reader.unpack("I")
+
+    probes = []
+    for _ in range(probe_count):
+        (length,) = reader.unpack("B")
+        probes.append(reader.take(length).decode("ascii"))
+
+    cores = []
+    for _ in range(core_count):
+        dropped, count = reader.unpack("II")
+        events = [reader.unpack("IBBH")[:3] for _ in range(count)]
+        cores.append({"dropped": dropped, "events": events})
+
+    histograms = []
+    for _ in range(core_count):
+        core_histograms = []
+        for _ in range(probe_count):
+            count, minimum, maximum = reader.unpack("III")
+            (total,) = reader.unpack("Q")
+            buckets = reader.unpack("%dI" % bucket_count)
+            core_histograms.append({"count": count, "min": minimum, "max": maximum, "sum": total, "buckets": buckets})
+        histograms.append(core_histograms)
+
+    if reader.take(len(END)) != END:
+        raise ValueError("missing end marker")
+
+    dump = {"cycles_per_us": cycles_per_us, "probes": probes, "cores": cores, "histograms": histograms}
+    return dump, reader.offset
+
+
+def find_dumps(data):
+    dumps = []
+    offset = data.find(MAGIC)
+    while offset >= 0:
+        try:
+            dump, end = parse_dump(data, offset)
+            dumps.append(dump)
+            offset = data.find(MAGIC, end)
+        except (EOFError, ValueError, UnicodeDecodeError) as error:
+            print("skipping dump at byte %d: %s" % (offset, error or "truncated"), file=sys.stderr)
+            offset = data.find(MAGIC, offset + 1)
+    return dumps
+
+
+def merge_histograms(dump, probe):
+    merged = {"count": 0, "min": None, "max": 0, "sum": 0, "buckets": None}
+    for core_histograms in dump["histograms"]:
+        histogram = core_histograms[probe]
+        if histogram["count"] == 0:
+            continue
+        merged["count"] += histogram["count"]
+        merged["sum"] += histogram["sum"]
+        merged["max"] = max(merged["max"], histogram["max"])
+        merged["min"] = histogram["min"] if merged["min"] is None else min(merged["min"], histogram["min"])
+        if merged["buckets"] is None:
+            merged["buckets"] = list(histogram["buckets"])
+        else:
+            merged["buckets"] = [a + b for a, b in zip(merged["buckets"], histogram["buckets"])]
+    return merged
+
+
+def percentile(histogram, fraction):
+    rank = histogram["count"] - int(histogram["count"] * (1 - fraction))
+    seen = 0
+    for bucket, count in enumerate(histogram["buckets"]):
+        seen += count
+        if seen >= rank:
+            return min(bucket_limit(bucket), histogram["max"])
+    return histogram["max"]
+
+
+def print_stats(dump):
+    us = float(dump["cycles_per_us"])
+    print("%-24s %8s %10s %10s %10s %10s" % ("probe", "count", "min us", "avg us", "max us", "p99 us"))
+    for probe, name in enumerate(dump["probes"]):
+        histogram = merge_histograms(dump, probe)
+        if histogram["count"] == 0:
+            continue
+        print("%-24s %8d %10.2f %10.2f %10.2f %10.2f" % (
+            name, histogram["count"], histogram["min"] / us, histogram["sum"] / histogram["count"] / us,
+            histogram["max"] / us, percentile(histogram, 0.99) / us))
+
+    for core, data in enumerate(dump["cores"]):
+        print("core%d: %d events, %d dropped" % (core, len(data["events"]), data["dropped"]))
+
+
+def chrome_events(dumps):
+    events = []
+    for dump in dumps:
+        us = float(dump["cycles_per_us"])
+        for core, data in enumerate(dump["cores"]):
+            for cycles, probe, end in data["events"]:
+                events.append({
+                    "name": dump["probes"][probe],
+                    "ph": "E" if end else "B",
+                    "ts": cycles / us,
+                    "pid": 0,
+                    "tid": core,
+                })
+    return {"traceEvents": events}
+
+
+def read_input(path, seconds):
+    if not path.startswith("/dev/") and not path.upper().startswith("COM"):
+        with open(path, "rb") as file:
+            return file.read()
+
+    import serial  # pyserial, only needed to capture straight from the board
+
+    data = bytearray()
+    with serial.Serial(path, timeout=0.1) as port:
+        deadline = time.time() + seconds
+        while time.time() < deadline:
+            data += port.read(4096)
+    return bytes(data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="capture file or serial port")
+    parser.add_argument("--seconds", type=float, default=5, help="time to capture from a serial port")
+    parser.add_argument("--chrome", help="write the events as a Chrome trace JSON file")
+    args = parser.parse_args()
+
+    dumps = find_dumps(read_input(args.input, args.seconds))
+    if not dumps:
+        print("no trace dump found", file=sys.stderr)
+        return 1
+
+    # Histograms are cumulative, the last dump has them all
+    print_stats(dumps[-1])
+
+    if args.chrome:
+        with open(args.chrome, "w") as file:
+            json.dump(chrome_events(dumps), file)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
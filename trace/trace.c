@@ -0,0 +1,304 @@
+#include "trace.h"
+
+#if TRACE_ENABLED
+
+#include <stdio.h>
+#include <string.h>
+#include "hardware/sync.h"
+#if PICO_ON_DEVICE
+#include "hardware/clocks.h"
+#include "hardware/structs/timer.h"
+#include "trace_systick.h"
+#endif
+
+const char *_traceProbeNames[TRACE_PROBE_COUNT] = {
+    "flash_erase",
+    "flash_program",
+    "flash_header_scan",
+    "adc_scan",
+    "shift_register_transfer",
+    "shift_register_dma_start",
+    "i2c_transaction",
+    "sensor_log_encode",
+};
+
+TraceCore _traceCores[2];
+#if PICO_ON_DEVICE
+uint32_t _traceCyclesPerUs = 125;
+uint32_t _traceResyncUs = SYSTICK_MASK / 125 / 2;
+#else
+// The host has no SysTick, its cycles are microseconds
+uint32_t _traceCyclesPerUs = 1;
+#endif
+
+// Floor of log2, no clz on the M0+ and the libgcc one is in flash
+uint8_t __time_critical_func(_trace_log2)(uint32_t value) {
+    uint8_t result = 0;
+    if (value >= 1u << 16) {
+        value >>= 16;
+        result += 16;
+    }
+    if (value >= 1u << 8) {
+        value >>= 8;
+        result += 8;
+    }
+    if (value >= 1u << 4) {
+        value >>= 4;
+        result += 4;
+    }
+    if (value >= 1u << 2) {
+        value >>= 2;
+        result += 2;
+    }
+    if (value >= 1u << 1) {
+        result += 1;
+    }
+    return result;
+}
+
+uint8_t __time_critical_func(_trace_bucket)(uint32_t cycles) {
+    if (cycles < 4) {
+        return cycles;
+    }
+    uint8_t octave = _trace_log2(cycles);
+    return (octave - 1) * 4 + ((cycles >> (octave - 2)) & 3);
+}
+
+// Highest value that falls in the bucket
+uint32_t _trace_bucket_limit(uint8_t bucket) {
+    if (bucket < 4) {
+        return bucket;
+    }
+    uint8_t octave = bucket / 4 + 1;
+    uint32_t width = 1u << (octave - 2);
+    return (4 + bucket % 4) * width + width - 1;
+}
+
+#if PICO_ON_DEVICE
+uint32_t __time_critical_func(_trace_cycles)(TraceCore *core) {
+    if (start_systick()) {
+        core->lastSystick = systick_hw->cvr;
+        core->lastUs = timer_hw->timerawl;
+    }
+
+    uint32_t systick = systick_hw->cvr;
+    uint32_t now = timer_hw->timerawl;
+    uint32_t elapsedUs = now - core->lastUs;
+
+    if (elapsedUs > _traceResyncUs) {
+        core->cycles += elapsedUs * _traceCyclesPerUs;
+    } else {
+        // SysTick counts down
+        core->cycles += (core->lastSystick - systick) & SYSTICK_MASK;
+    }
+    core->lastSystick = systick;
+    core->lastUs = now;
+    return core->cycles;
+}
+#else
+uint32_t _trace_cycles(TraceCore *core) {
+    return time_us_32();
+}
+#endif
+
+void __time_critical_func(_trace_add_duration)(TraceHistogram *histogram, uint32_t cycles) {
+    if (histogram->count == 0 || cycles < histogram->min) {
+        histogram->min = cycles;
+    }
+    if (cycles > histogram->max) {
+        histogram->max = cycles;
+    }
+    histogram->count++;
+    histogram->sum += cycles;
+    histogram->buckets[_trace_bucket(cycles)]++;
+}
+
+// Reads the clock so cycles can be turned into time, call once on startup
+void init_trace() {
+#if PICO_ON_DEVICE
+    _traceCyclesPerUs = clock_get_hz(clk_sys) / 1000000;
+    _traceResyncUs = SYSTICK_MASK / _traceCyclesPerUs / 2;
+#endif
+    memset(_traceCores, 0, sizeof(_traceCores));
+}
+
+/**
+ * @brief Records one begin or end event, use TRACE_BEGIN/TRACE_END instead.
+ *
+ * Runs from RAM with interrupts held off for a few cycles, so it can be used in IRQ handlers and
+ * while the other core writes flash.
+ *
+ * @param probe Operation being traced.
+ * @param end False for begin, true for end.
+ */
+void __time_critical_func(trace_record)(TraceProbe probe, bool end) {
+    TraceCore *core = &_traceCores[get_core_num()];
+    uint32_t irqStatus = save_and_disable_interrupts();
+
+    uint32_t cycles = _trace_cycles(core);
+    uint32_t probeMask = 1u << probe;
+    if (!end) {
+        core->beginCycles[probe] = cycles;
+        core->openProbes |= probeMask;
+    } else if (core->openProbes & probeMask) {
+        core->openProbes &= ~probeMask;
+        _trace_add_duration(&core->histograms[probe], cycles - core->beginCycles[probe]);
+    }
+
+    uint32_t head = core->eventHead;
+    if (head - core->eventTail == TRACE_EVENT_QUEUE_SIZE) {
+        core->droppedEvents++;
+    } else {
+        TraceEvent *event = &core->events[head % TRACE_EVENT_QUEUE_SIZE];
+        event->cycles = cycles;
+        event->probe = probe;
+        event->end = end;
+
+        // Event must be written before it is published
+        __dmb();
+        core->eventHead = head + 1;
+    }
+
+    restore_interrupts(irqStatus);
+}
+
+/**
+ * @brief Returns the statistics of one probe, both cores merged.
+ *
+ * @param probe Probe to read.
+ * @param count Number of begin/end pairs.
+ * @param minUs Shortest duration.
+ * @param avgUs Average duration.
+ * @param maxUs Longest duration.
+ * @param p99Us 99th percentile, upper limit of its histogram bucket so it is within 25%.
+ */
+void get_trace_stats(TraceProbe probe, uint32_t *count, float *minUs, float *avgUs, float *maxUs, float *p99Us) {
+    TraceHistogram merged = {0};
+    for (uint8_t c = 0; c < 2; c++) {
+        TraceHistogram *histogram = &_traceCores[c].histograms[probe];
+        if (histogram->count == 0) {
+            continue;
+        }
+        if (merged.count == 0 || histogram->min < merged.min) {
+            merged.min = histogram->min;
+        }
+        if (histogram->max > merged.max) {
+            merged.max = histogram->max;
+        }
+        merged.count += histogram->count;
+        merged.sum += histogram->sum;
+        for (uint8_t b = 0; b < TRACE_HISTOGRAM_BUCKETS; b++) {
+            merged.buckets[b] += histogram->buckets[b];
+        }
+    }
+
+    *count = merged.count;
+    if (merged.count == 0) {
+        *minUs = *avgUs = *maxUs = *p99Us = 0;
+        return;
+    }
+
+    uint32_t rank = merged.count - merged.count / 100;
+    uint32_t seen = 0;
+    uint32_t p99 = merged.max;
+    for (uint8_t b = 0; b < TRACE_HISTOGRAM_BUCKETS; b++) {
+        seen += merged.buckets[b];
+        if (seen >= rank) {
+            p99 = MIN(_trace_bucket_limit(b), merged.max);
+            break;
+        }
+    }
+
+    *minUs = (float) merged.min / _traceCyclesPerUs;
+    *avgUs = (float) merged.sum / merged.count / _traceCyclesPerUs;
+    *maxUs = (float) merged.max / _traceCyclesPerUs;
+    *p99Us = (float) p99 / _traceCyclesPerUs;
+}
+
+void trace_print() {
+    printf("%-24s %8s %10s %10s %10s %10s\n", "probe", "count", "min us", "avg us", "max us", "p99 us");
+    for (uint8_t p = 0; p < TRACE_PROBE_COUNT; p++) {
+        uint32_t count;
+        float minUs, avgUs, maxUs, p99Us;
+        get_trace_stats(p, &count, &minUs, &avgUs, &maxUs, &p99Us);
+        if (count > 0) {
+            printf("%-24s %8u %10.2f %10.2f %10.2f %10.2f\n", _traceProbeNames[p], count, minUs, avgUs, maxUs, p99Us);
+        }
+    }
+}
+
+// Raw bytes, putchar would turn 0x0A into 0x0D 0x0A on the device
+void _trace_write(const void *data, uint32_t length) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    for (uint32_t i = 0; i < length; i++) {
+#if PICO_ON_DEVICE
+        putchar_raw(bytes[i]);
+#else
+        putchar(bytes[i]);
+#endif
+    }
+}
+
+void _trace_write_u32(uint32_t value) {
+    _trace_write(&value, sizeof(value));
+}
+
+/**
+ * @brief Sends the events recorded since the last dump and all histograms over stdio.
+ *
+ * Little endian layout, see tools/trace_decode.py:
+ * magic, version, core count, probe count, bucket count, cycles per us,
+ * probe names (length + chars),
+ * per core: dropped events, event count, events,
+ * per core and probe: count, min, max, sum (64 bit), buckets,
+ * end marker.
+ */
+void trace_dump() {
+    _trace_write_u32(TRACE_DUMP_MAGIC);
+    uint8_t header[4] = {TRACE_DUMP_VERSION, 2, TRACE_PROBE_COUNT, TRACE_HISTOGRAM_BUCKETS};
+    _trace_write(header, sizeof(header));
+    _trace_write_u32(_traceCyclesPerUs);
+
+    for (uint8_t p = 0; p < TRACE_PROBE_COUNT; p++) {
+        uint8_t length = strlen(_traceProbeNames[p]);
+        _trace_write(&length, 1);
+        _trace_write(_traceProbeNames[p], length);
+    }
+
+    for (uint8_t c = 0; c < 2; c++) {
+        TraceCore *core = &_traceCores[c];
+        uint32_t tail = core->eventTail;
+        uint32_t head = core->eventHead;
+
+        // Events must not be read before head was seen
+        __dmb();
+        _trace_write_u32(core->droppedEvents);
+        _trace_write_u32(head - tail);
+        for (uint32_t i = tail; i != head; i++) {
+            _trace_write(&core->events[i % TRACE_EVENT_QUEUE_SIZE], sizeof(TraceEvent));
+        }
+
+        __dmb();
+        core->eventTail = head;
+    }
+
+    for (uint8_t c = 0; c < 2; c++) {
+        for (uint8_t p = 0; p < TRACE_PROBE_COUNT; p++) {
+            TraceHistogram *histogram = &_traceCores[c].histograms[p];
+            _trace_write_u32(histogram->count);
+            _trace_write_u32(histogram->min);
+            _trace_write_u32(histogram->max);
+            _trace_write(&histogram->sum, sizeof(histogram->sum));
+            _trace_write(histogram->buckets, sizeof(histogram->buckets));
+        }
+    }
+
+    _trace_write_u32(TRACE_DUMP_END);
+#if PICO_ON_DEVICE
+    stdio_flush();
+#else
+    fflush(stdout);
+#endif
+}
+
+#endif
@@ -0,0 +1,105 @@
+/**
+ * @brief Compile time switchable tracing of the hot paths in every library.
+ *
+ * *** Usage ***
+ * - Configure with -DPICO_LIBRARIES_TRACE=ON to define TRACE_ENABLED=1, otherwise TRACE_BEGIN/TRACE_END
+ *   and the other entry points compile to nothing and no memory is used.
+ * - Call init_trace() once on startup, after the system clock is set, main.c and the benchmark do.
+ * - TRACE_BEGIN(probe)/TRACE_END(probe) around an operation records two events with a cycle timestamp
+ *   in the ring of the core running it, and adds the duration to the probe histogram of that core.
+ * - trace_print() prints min/avg/max/p99 per probe, trace_dump() sends events and histograms as a binary
+ *   dump over stdio (USB), decoded on the host with tools/trace_decode.py.
+ *
+ * *** Timestamps ***
+ * - Cycles come from the SysTick of each core, extended to 32 bits on every event. If more than half
+ *   a SysTick period (67ms at 125MHz) passed since the previous event of that core the 24 bit SysTick
+ *   may have wrapped, the microsecond timer is used to catch up instead.
+ * - A begin and its end must run on the same core, the same probe can't be nested or overlap with
+ *   itself on one core.
+ * - With PICO_PLATFORM=host there is no SysTick, cycles are microseconds from time_us_32().
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "pico/stdlib.h"
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 0
+#endif
+
+typedef enum TraceProbe {
+    TRACE_FLASH_ERASE,
+    TRACE_FLASH_PROGRAM,
+    TRACE_FLASH_HEADER_SCAN,
+    TRACE_ADC_SCAN,
+    TRACE_SHIFT_REGISTER_TRANSFER,
+    TRACE_SHIFT_REGISTER_DMA_START,
+    TRACE_I2C_TRANSACTION,
+    TRACE_SENSOR_LOG_ENCODE,
+    TRACE_PROBE_COUNT,
+} TraceProbe;
+
+#if TRACE_ENABLED
+
+#define TRACE_EVENT_QUEUE_SIZE 512
+
+// 4 buckets per power of 2, values under 4 cycles get their own bucket
+#define TRACE_HISTOGRAM_BUCKETS 124
+
+#define TRACE_DUMP_MAGIC 0x31435254  // "TRC1"
+#define TRACE_DUMP_END 0x31444E45  // "END1"
+#define TRACE_DUMP_VERSION 1
+
+typedef struct TraceEvent {
+    uint32_t cycles;
+    uint8_t probe;
+    uint8_t end;
+    uint16_t reserved;
+} TraceEvent;
+
+typedef struct TraceHistogram {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[TRACE_HISTOGRAM_BUCKETS];
+} TraceHistogram;
+
+typedef struct TraceCore {
+    // Events, written by the core itself and drained by trace_dump
+    TraceEvent events[TRACE_EVENT_QUEUE_SIZE];
+    volatile uint32_t eventHead;
+    volatile uint32_t eventTail;
+    volatile uint32_t droppedEvents;
+
+    // Extended cycle counter
+    uint32_t cycles;
+    uint32_t lastSystick;
+    uint32_t lastUs;
+
+    uint32_t openProbes;  // Bit n set between TRACE_BEGIN and TRACE_END of probe n
+    uint32_t beginCycles[TRACE_PROBE_COUNT];
+    TraceHistogram histograms[TRACE_PROBE_COUNT];
+} TraceCore;
+
+void init_trace();
+void trace_record(TraceProbe probe, bool end);
+void get_trace_stats(TraceProbe probe, uint32_t *count, float *minUs, float *avgUs, float *maxUs, float *p99Us);
+void trace_print();
+void trace_dump();
+
+#define TRACE_BEGIN(probe) trace_record(probe, false)
+#define TRACE_END(probe) trace_record(probe, true)
+
+#else
+
+#define init_trace() ((void) 0)
+#define trace_print() ((void) 0)
+#define trace_dump() ((void) 0)
+#define TRACE_BEGIN(probe) ((void) 0)
+#define TRACE_END(probe) ((void) 0)
+
+#endif
+
+#endif
@@ -0,0 +1,30 @@
+/**
+ * @brief SysTick of the calling core as a processor cycle counter.
+ *
+ * Shared by trace and the libraries timing their IRQ handlers in cycles. Device only, the host
+ * has no SysTick.
+ */
+
+#ifndef TRACE_SYSTICK_H
+#define TRACE_SYSTICK_H
+
+#include "pico/stdlib.h"
+#include "hardware/structs/systick.h"
+
+// SysTick counts processor cycles down from SYSTICK_MASK and wraps
+#define SYSTICK_ENABLE 0x1
+#define SYSTICK_PROCESSOR_CLOCK 0x4
+#define SYSTICK_MASK 0xFFFFFF
+
+// SysTick is per core and off after reset, returns true if it was started by this call
+static inline bool start_systick() {
+    if (systick_hw->csr & SYSTICK_ENABLE) {
+        return false;
+    }
+    systick_hw->rvr = SYSTICK_MASK;
+    systick_hw->cvr = 0;
+    systick_hw->csr = SYSTICK_ENABLE | SYSTICK_PROCESSOR_CLOCK;
+    return true;
+}
+
+#endif